@@ -0,0 +1,71 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__AnalysisContext_h
+#define INCLUDED__AnalysisContext_h
+
+#include "Arena.h"
+#include "Board.h"
+#include "ShapeMatches.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// Everything one analysis (Board::findMatchingPairs() and GameState::possibleMoves()) needs besides the engines' own
+// pooled workers: an arena for the temporaries of a single call, and the containers that hold its results. Results
+// are cleared rather than destroyed, and group objects come back for reuse once nobody else holds them, so analysing
+// board after board with one context reaches a steady state with no heap allocations on a single thread. A context
+// serves one analysis at a time; each call overwrites the last call's results.
+class AnalysisContext {
+public:
+    Arena arena;
+
+    // Which per-color loops findMatchingPairs() runs. Only benchmarks ask for the generic ones.
+    Board::ColorLoops colorLoops = Board::ColorLoops::fixed;
+
+    // The last findMatchingPairs() result.
+    Board::Pairs pairs;
+
+    // The last possibleMoves() result.
+    std::vector<std::shared_ptr<ShapeMatches>> matcheses;
+
+    // An empty group with room for n matches: one from an earlier result if there is one, with the least capacity that
+    // is enough, or else a new one.
+    std::shared_ptr<ShapeMatches> group(size_t n) {
+        std::shared_ptr<ShapeMatches> g;
+        if (!spares_.empty()) {
+            auto i = std::lower_bound(begin(spares_), end(spares_), n, [](std::shared_ptr<ShapeMatches> const & g, size_t n) {
+                return g->matches.capacity() < n;
+            });
+            if (i == end(spares_))
+                --i;
+            g = std::move(*i);
+            spares_.erase(i);
+        } else {
+            // Make room to recycle it now, while the call is allocating anyway, rather than in the next call.
+            g = std::make_shared<ShapeMatches>();
+            if (spares_.capacity() <= matcheses.size())
+                spares_.reserve(2 * matcheses.size() + 1);
+        }
+        g->matches.clear();
+        g->hinted = 0;
+        return g;
+    }
+
+    // Set the last possibleMoves() result aside, for group() to draw on. Groups that something else still holds are
+    // left to it.
+    void recycleMatcheses() {
+        for (auto & g : matcheses)
+            if (g.use_count() == 1)
+                spares_.push_back(std::move(g));
+        matcheses.clear();
+        std::sort(begin(spares_), end(spares_), [](std::shared_ptr<ShapeMatches> const & a, std::shared_ptr<ShapeMatches> const & b) {
+            return a->matches.capacity() < b->matches.capacity();
+        });
+    }
+
+private:
+    std::vector<std::shared_ptr<ShapeMatches>> spares_;
+};
+
+#endif // INCLUDED__AnalysisContext_h
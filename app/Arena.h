@@ -0,0 +1,87 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__Arena_h
+#define INCLUDED__Arena_h
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Monotonic scratch memory. Allocation bumps a pointer through a list of blocks, nothing is freed piecemeal, and
+// reset() makes every block available again at once. Blocks are kept across resets, and a call that repeats the last
+// call's allocations takes the same blocks in the same order, so once an arena has grown to what a call needs, the
+// next call doesn't touch the heap.
+class Arena {
+public:
+    explicit Arena(size_t blockSize = 64 << 10) : blockSize_(blockSize) { }
+
+    Arena(Arena const &) = delete;
+    Arena & operator=(Arena const &) = delete;
+
+    void * allocate(size_t n, size_t align) {
+        assert(align <= alignof(std::max_align_t));
+        for (;; ++block_, used_ = 0) {
+            if (block_ == blocks_.size()) {
+                size_t size = std::max(blockSize_, n);
+                blocks_.push_back(Block{std::unique_ptr<char[]>(new char[size]), size});
+            }
+            auto & b = blocks_[block_];
+            size_t at = (used_ + align - 1) & ~(align - 1);
+            if (at + n <= b.size) {
+                used_ = at + n;
+                return b.data.get() + at;
+            }
+        }
+    }
+
+    // Forget every allocation. Anything still using the arena's memory must be gone first.
+    void reset() {
+        block_ = 0;
+        used_ = 0;
+    }
+
+    size_t capacity() const {
+        size_t total = 0;
+        for (auto const & b : blocks_)
+            total += b.size;
+        return total;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    size_t blockSize_;
+    std::vector<Block> blocks_;
+    size_t block_ = 0, used_ = 0;
+};
+
+// An allocator for standard containers that lives in an Arena. Deallocation is a no-op; the memory comes back at the
+// arena's next reset().
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    Arena * arena;
+
+    explicit ArenaAllocator(Arena & arena) : arena(&arena) { }
+
+    template <typename U>
+    ArenaAllocator(ArenaAllocator<U> const & other) : arena(other.arena) { }
+
+    T * allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T *, size_t) { }
+
+    template <typename U> bool operator==(ArenaAllocator<U> const & other) const { return arena == other.arena; }
+    template <typename U> bool operator!=(ArenaAllocator<U> const & other) const { return arena != other.arena; }
+};
+
+// A vector in an arena.
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+#endif // INCLUDED__Arena_h
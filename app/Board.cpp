@@ -1,194 +1,697 @@
 //  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
 
 #include "Board.h"
-
-#include <unordered_map>
+#include "AnalysisContext.h"
+#include "ColorCount.h"
+#include "Connectivity.h"
+#include "Executor.h"
+#include "MemoryProfile.h"
+#include "Metrics.h"
+#include "ScratchPool.h"
+#include "Trace.h"
+
+#include <atomic>
 #include <cassert>
 
 using namespace brac;
 
-bool Board::selectionsMatch(Board const (&prerotated)[4], BitBoard const & a, BitBoard const & b)
-{
-    size_t nColors = prerotated[0].nColors();
+namespace {
 
-    assert(std::all_of(std::begin(prerotated) + 1, std::end(prerotated),
-                       [&](Board const & b) { return b.nColors() == nColors; }));
+    typedef Board::Pairs Pairs;
 
-    int sm1 = a.marginS(), wm1 = a.marginW();
+    // A matching pair plus the cell that the pair's transform carries the lowest cell of bbs[0] onto. Symmetric
+    // shapes can match under more than one transform, and each is grown separately, so that a pair's fate doesn't
+    // depend on which transform happened to reach it first.
+    struct Visit {
+        std::array<BitBoard, 2> bbs;
+        uint8_t anchor;
 
-    BitBoard * cc = new (alloca(nColors * sizeof(BitBoard))) BitBoard[nColors];
-    uint32_t cc_set = 0;
+        bool BRAC_OPERATOR(==)(Visit const & v) const { return anchor == v.anchor && bbs == v.bbs; }
+    };
 
-    auto lazyColorA = [&](size_t i) -> BitBoard const & {
-        uint32_t m = 1 << i;
-        if (!(cc_set & m)) {
-            cc[i] = (prerotated[0].colors[i] & a).shiftWS(wm1, sm1);
-            cc_set |= m;
+    struct VisitHash {
+        size_t operator()(Visit const & v) const {
+            auto const & b = v.bbs;
+            return hashWords({b[0].a, b[0].b, b[0].c, b[0].d, b[1].a, b[1].b, b[1].c, b[1].d, v.anchor});
         }
-        return cc[i];
     };
 
-    int nm = b.marginN(), sm = b.marginS(), em = b.marginE(), wm = b.marginW();
-
-    for (size_t i = 0; i < nColors; ++i)
-        if (lazyColorA(i) != (prerotated[0].colors[i] & b).shiftWS(wm, sm))
-            goto b1;
-    return true;
-
-b1:
-    auto b1 = b.rotL();
-    for (size_t i = 0; i < nColors; ++i)
-        if (lazyColorA(i) != (prerotated[1].colors[i] & b1).shiftWS(nm, wm))
-            goto b2;
-    return true;
-
-b2:
-    auto b2 = b.reverse();
-    for (size_t i = 0; i < nColors; ++i)
-        if (lazyColorA(i) != (prerotated[2].colors[i] & b2).shiftWS(em, nm))
-            goto b3;
-    return true;
-
-b3:
-    auto b3 = b.rotR();
-    for (size_t i = 0; i < nColors; ++i)
-        if (lazyColorA(i) != (prerotated[3].colors[i] & b3).shiftWS(sm, em))
-            goto b4;
-    return true;
-
-b4:
-    return false;
-}
+    uint8_t position(BitBoard const & single) {
+        return 16 * single.marginS() + single.marginW();
+    }
 
-std::unordered_set<std::array<BitBoard, 2>> Board::findMatchingPairs() const {
-    std::unordered_set<std::array<BitBoard, 2>> result, discarded;
-    std::vector<std::array<BitBoard, 2>> result_masks; result_masks.reserve(1 << 16);
-    auto mask = computeMask();
-    int analyses = 0, tests = 0, matches = 0, overlaps = 0;
-
-    // Build an array of colors in each orientation.
-    Board const rots[4] = { *this, rotL(), reverse(), rotR() };
-    int rotcolors[4][16][16];
-    for (int8_t r = 0; r < 4; ++r)
-        for (size_t y = 0; y < 16; ++y)
-            for (size_t x = 0; x < 16; ++x)
-                rotcolors[r][y][x] = rots[r].color(x, y);
-
-    // Return true iff a match was found directly or recursively (even if it was already in the result or discarded).
-    std::function<bool(const std::array<BitBoard, 2>& bbs, BitBoard::ShiftRotate sr, int level)> analysePair;
-    analysePair = [&](const std::array<BitBoard, 2>& bbs, BitBoard::ShiftRotate sr, int level) -> bool {
-        ++analyses;
-        if (!(bbs[0] & bbs[1]) && bbs[0] < bbs[1]) {
-            if (discarded.count(bbs) || result.count(bbs)) {
-                ++overlaps;
-                return true;
-            } else {
-                ++tests;
-                if (selectionsMatch(rots, bbs[0], bbs[1])) {
-                    ++matches;
+    // Rotate by k quarter turns, in the same sense as ShiftRotate.
+    BitBoard rotate(BitBoard const & bb, int k) {
+        switch (k & 3) {
+            case 1 : return bb.rotL();
+            case 2 : return bb.reverse();
+            case 3 : return bb.rotR();
+            default: return bb;
+        }
+    }
+
+    template <size_t N>
+    bool sameColor(Board const & board, BitBoard const & lo1, BitBoard const & lo2) {
+        for (size_t c = 0; c < colorCount<N>(board); ++c)
+            if (board.colors[c] & lo1)
+                return !!(board.colors[c] & lo2);
+        return false;
+    }
+
+    template <size_t N>
+    BitBoard maskOf(Board const & board) {
+        auto mask = BitBoard::empty();
+        for (size_t c = 0; c < colorCount<N>(board); ++c)
+            mask |= board.colors[c];
+        return mask;
+    }
+
+    // Workers come from a pool that outlives the call, so their sets keep the capacity they grew to last time. The
+    // list of them lives in the call's arena.
+    template <typename Worker>
+    using Workers = ArenaVector<typename ScratchPool<Worker>::Ptr>;
+
+    template <typename Worker>
+    Workers<Worker> takeWorkers(ScratchPool<Worker> & pool, size_t nThreads, Arena & arena) {
+        Workers<Worker> workers{ArenaAllocator<typename ScratchPool<Worker>::Ptr>(arena)};
+        workers.reserve(std::max<size_t>(nThreads, 1));
+        for (size_t i = 0; i < std::max<size_t>(nThreads, 1); ++i) {
+            workers.push_back(pool.take());
+            workers.back()->reset();
+        }
+        return workers;
+    }
+
+    // Run work(worker) for each worker, spread over the shared executor if there is more than one, at the caller's
+    // priority. Workers charge their allocations to the caller's memory scope.
+    template <typename Workers, typename F>
+    void runWorkers(Workers & workers, F work) {
+        if (workers.size() == 1) {
+            work(*workers[0]);
+        } else {
+            int scope = MemoryProfile::current();
+            Executor::shared().forEach(workers.size(), [&](size_t i) {
+                MemoryProfile::Scope inherit(scope);
+                work(*workers[i]);
+            });
+        }
+    }
+
+    bool cancelled(Board::Cancel const * cancel) {
+        return cancel && cancel->load(std::memory_order_relaxed);
+    }
+
+    template <typename Workers>
+    void sumStats(Workers const & workers, Board::Stats * stats) {
+        Board::Stats total{0, 0, 0, 0};
+        for (auto const & w : workers) {
+            total.analyses += w->stats.analyses;
+            total.tests    += w->stats.tests;
+            total.matches  += w->stats.matches;
+            total.overlaps += w->stats.overlaps;
+        }
+        METRIC_COUNT("finder.analyses", total.analyses);
+        METRIC_COUNT("finder.tests"   , total.tests   );
+        METRIC_COUNT("finder.matches" , total.matches );
+        METRIC_COUNT("finder.overlaps", total.overlaps);
+        if (stats)
+            *stats = total;
+    }
+
+    // Triples of one shape, bucketed by their colors: bucket c0 + n c1 + n² c2 on an n-color board. The buckets are
+    // slices of one arena, laid out by a counting sort, so once the arena has grown to size, filling it allocates
+    // nothing.
+    class TripleTable {
+    public:
+        struct Bucket {
+            BitBoard::WithOrientation const * b, * e;
+
+            BitBoard::WithOrientation const * begin() const { return b; }
+            BitBoard::WithOrientation const * end  () const { return e; }
+            size_t size () const { return e - b; }
+            bool   empty() const { return b == e; }
+
+            friend BitBoard::WithOrientation const * begin(Bucket const & b) { return b.begin(); }
+            friend BitBoard::WithOrientation const * end  (Bucket const & b) { return b.end  (); }
+        };
+
+        size_t nBuckets() const { return offsets_.size() - 1; }
+        Bucket operator[](size_t k) const { return Bucket{arena_.data() + offsets_[k], arena_.data() + offsets_[k + 1]}; }
+
+        // Fill with the triples that each(f) reports as f(key, x, y, r): triple rotated by -r and shifted to (x, y).
+        template <typename Each>
+        void fill(size_t nBuckets, BitBoard const & triple, Each each) {
+            offsets_.assign(nBuckets + 1, 0);
+            each([&](size_t k, int8_t, int8_t, int8_t) { ++offsets_[k + 1]; });
+            std::partial_sum(begin(offsets_), end(offsets_), begin(offsets_));
+
+            arena_.resize(offsets_.back());
+            cursors_.assign(begin(offsets_), end(offsets_) - 1);
+            each([&](size_t k, int8_t x, int8_t y, int8_t r) {
+                arena_[cursors_[k]++] = BitBoard::ShiftRotate{{x, y}, static_cast<int8_t>(-r)}(triple);
+            });
+        }
 
-                    //fprintf(stderr, "Analyse[%3d] %016llx:%016llx:%016llx:%016llx <-> %016llx:%016llx:%016llx:%016llx\n",
-                    //        level, bbs[0].a, bbs[0].b, bbs[0].c, bbs[0].d, bbs[1].a, bbs[1].b, bbs[1].c, bbs[1].d);
+    private:
+        std::vector<BitBoard::WithOrientation> arena_;
+        std::vector<uint32_t> offsets_, cursors_;
+    };
 
-                    auto neighborhood = [&](BitBoard const & bb) { return bb.nhood4() & ~bb & mask; };
+    struct Triples {
+        TripleTable straight, ell;
 
-                    bool foundBigger = false;
-                    for (auto hood1 = neighborhood(bbs[0]); hood1;) {
-                        auto lo1 = hood1.ls1b();
-                        BitBoard test1 = bbs[0] | lo1;
-                        hood1 &= ~lo1;
+        // Every bucket of both shapes.
+        template <typename F>
+        void foreach(F f) const {
+            for (auto const * t : {&straight, &ell})
+                for (size_t k = 0; k < t->nBuckets(); ++k)
+                    f((*t)[k]);
+        }
+    };
 
-                        if (auto lo2 = sr * lo1) {
-                            BitBoard test2 = bbs[1] | lo2;
-                            foundBigger |= analysePair({test1, test2}, sr, level + 1);
+    // Report every straight triple in rotcolors (colors of each cell in each orientation, -1 for none) to f, as
+    // TripleTable::fill() expects.
+    struct StraightTriples {
+        int const (*rotcolors)[16][16];
+        size_t n;
+
+        template <typename F>
+        void operator()(F f) const {
+            for (int8_t r = 0; r < 4; ++r)
+                for (int8_t y = 0; y < 16; ++y)
+                    for (int8_t x = 0; x < 14; ++x) {
+                        int const * c = rotcolors[r][y] + x;
+                        int c0 = c[0], c1 = c[1], c2 = c[2];
+
+                        if (~c0 && ~c1 && ~c2 &&    // no missing dots and ...
+                            c0 <= c2)               //   not greater of asymmetric pair
+                        {
+                            f(c0 + n * (c1 + n * c2), x, y, r);
                         }
                     }
-                    if (!foundBigger) {
-                        result.insert(bbs);
-                        result_masks.push_back({~bbs[0], ~bbs[1]});
-                    } else {
-                        discarded.insert(bbs);
+        }
+    };
+
+    // Likewise for L-triples.
+    struct EllTriples {
+        int const (*rotcolors)[16][16];
+        size_t n;
+
+        template <typename F>
+        void operator()(F f) const {
+            for (int8_t r = 0; r < 4; ++r)
+                for (int8_t y = 0; y < 15; ++y)
+                    for (int8_t x = 0; x < 15; ++x) {
+                        int const (&c)[16][16] = rotcolors[r];
+                        int c0 = c[y + 1][x], c1 = c[y][x], c2 = c[y][x + 1];
+                        if (~c0 && ~c1 && ~c2)
+                            f(c0 + n * (c1 + n * c2), x, y, r);
                     }
-                    return true;
+        }
+    };
+
+    // Bucket every straight and L-shaped triple of dots by its colors, each in the orientation that carries the
+    // canonical triple onto it. Two disjoint triples from the same bucket are a matching pair. The tables come from a
+    // pool, so their arenas are reused from call to call.
+    template <size_t N>
+    ScratchPool<Triples>::Ptr collectTriples(Board const & board) {
+        static ScratchPool<Triples> pool;
+        auto triples = pool.take();
+
+        // Build an array of colors in each orientation.
+        int rotcolors[4][16][16];
+        std::fill(&rotcolors[0][0][0], &rotcolors[0][0][0] + 4 * 16 * 16, -1);
+        for (int r = 0; r < 4; ++r)
+            for (size_t c = 0; c < colorCount<N>(board); ++c)
+                for (auto dots = rotate(board.colors[c], r); dots;) {
+                    auto p = dots.ls1b();
+                    dots &= ~p;
+                    rotcolors[r][p.marginS()][p.marginW()] = static_cast<int>(c);
+                }
+
+        size_t const n = colorCount<N>(board);
+        triples->straight.fill(n * n * n, BitBoard{7, 0, 0, 0}, StraightTriples{rotcolors, n});
+        triples->ell     .fill(n * n * n, BitBoard{3 + (1 << 16), 0, 0, 0}, EllTriples{rotcolors, n});
+
+        return triples;
+    }
+
+    // A connected set of cells on its way to being a maximal one that is disjoint from its image: the cells so far, the
+    // cells left out of it, and the cells that its image or preimage rules out.
+    struct Growth {
+        BitBoard cells, excluded, barred;
+    };
+
+    // Call emit(a) with each maximal connected a ⊆ region of three or more cells that is disjoint from forward(a): one
+    // that no cell of region next to it can join without meeting its image. region is a connected set of cells whose
+    // colors agree with their images, which overlaps its own image, so a cell and its image can't both be taken.
+    //
+    // Only maximal sets are produced, rather than every subset on the way to them, by branching only on cells that
+    // could go either way. Only the cells the set can still reach without crossing a left-out or ruled-out one can
+    // ever join it. A cell next to the set whose image and preimage are not among them is in every maximal set grown
+    // from there, so it is added outright; and a branch that has left out such a cell is dropped, since none of its
+    // sets can be maximal. Each set is grown only from its lowest cell, so each is
+    // emitted once. tests counts the steps taken.
+    template <typename Forward, typename Inverse, typename Emit>
+    void forEachMaximalDisjoint(BitBoard const & region, Forward forward, Inverse inverse, std::vector<Growth> & stack,
+                                int & tests, Emit emit) {
+        auto barredBy = [&](BitBoard const & bb) { return (forward(bb) | inverse(bb)) & region; };
+
+        // A cell that is its own image can never be taken.
+        auto fixed = BitBoard::empty();
+        for (auto cells = region; cells;) {
+            auto p = cells.ls1b();
+            cells &= ~p;
+            if (p & forward(p))
+                fixed |= p;
+        }
+
+        auto below = BitBoard::empty();
+        for (auto seeds = region & ~fixed; seeds;) {
+            auto s = seeds.ls1b();
+            seeds &= ~s;
+            stack.push_back(Growth{s, below, fixed | barredBy(s)});
+            below |= s;
+            while (!stack.empty()) {
+                auto g = stack.back();
+                stack.pop_back();
+                for (;;) {
+                    ++tests;
+                    auto open = g.cells.nhood4() & region & ~g.cells & ~g.barred;
+                    auto live = region & ~(g.cells | g.excluded | g.barred);
+                    auto contested = barredBy(Connectivity::fill(g.cells, g.cells | live) & live);
+                    if (open & g.excluded & ~contested)
+                        break;
+                    auto candidates = open & ~g.excluded;
+                    if (!candidates) {
+                        if (!open && g.cells.count() >= 3)
+                            emit(g.cells);
+                        break;
+                    }
+                    if (auto forced = candidates & ~contested) {
+                        g.cells |= forced;
+                        g.barred |= barredBy(forced);
+                        continue;
+                    }
+                    auto q = candidates.ls1b();
+                    stack.push_back(Growth{g.cells, g.excluded | q, g.barred});
+                    g.cells |= q;
+                    g.barred |= barredBy(q);
                 }
             }
         }
+    }
+
+    template <size_t N>
+    void findBySweep(AnalysisContext & ctx, Board const & board, Board::Stats * stats, size_t nThreads, BitBoard const * cleared,
+                     Board::Cancel const * cancel);
+
+    template <size_t N>
+    bool growable(Board const & board, BitBoard const & mask, BitBoard const & a, BitBoard const & b);
+
+    // Seed pairs from every pair of like-colored triples and grow them one cell at a time. Every connected shape of
+    // three or more dots has a triple through each of its dots, so given cleared cells, seeding only from triples next
+    // to them still reaches every pair next to them, under every transform that relates the pair.
+    //
+    // Seeding pairs every triple in a bucket with every other, so the work grows with the square of the bucket size,
+    // whereas the sweep's is fixed by the board size. Given adaptive, a search that would seed more pairs than a sweep
+    // costs is handed to the sweep instead.
+    //
+    // The pairs go into ctx.pairs, and the call's temporaries into ctx.arena.
+    template <size_t N>
+    void findByTriples(AnalysisContext & ctx, Board const & board, Board::Stats * stats, size_t nThreads, BitBoard const * cleared,
+                       Board::Cancel const * cancel, bool adaptive = false) {
+        auto mask = maskOf<N>(board);
+        auto near = cleared ? cleared->nhood4() & mask : mask;
+
+        auto triples = collectTriples<N>(board);
+
+#ifdef METRICS
+        {
+            size_t largest = 0;
+            triples->foreach([&](TripleTable::Bucket const & set) {
+                if (!set.empty())
+                    METRIC_HISTOGRAM("finder.bucketSize", set.size());
+                largest = std::max<size_t>(largest, set.size());
+            });
+            if (largest)    // Late in a game, there may be none.
+                METRIC_HISTOGRAM("finder.largestBucket", largest);
+        }
+#endif
+
+        // Carve the triple sets into tasks of roughly equal numbers of seed pairs. Big sets are sliced by their first
+        // element, so that a single dominant color triple can still be spread across workers.
+        struct Task {
+            TripleTable::Bucket set;
+            size_t begin, end, cost;
+        };
+        ArenaVector<Task> tasks{ArenaAllocator<Task>(ctx.arena)};
+        {
+            size_t total = 0;
+            triples->foreach([&](TripleTable::Bucket const & set) {
+                if (!set.empty())
+                    total += set.size() * (set.size() - 1) / 2;
+            });
+            size_t grain = nThreads > 1 ? std::max<size_t>(total / (8 * nThreads), 1) : total + 1;
+
+            triples->foreach([&](TripleTable::Bucket const & set) {
+                size_t n = set.size();
+                if (cleared && std::none_of(begin(set), end(set), [&](BitBoard::WithOrientation const & t) { return !!(t.bb & near); }))
+                    return;
+                for (size_t b = 0; b < n;) {
+                    size_t e = b, cost = 0;
+                    while (e < n && (e == b || cost < grain))
+                        cost += n - 1 - e++;
+                    tasks.push_back(Task{set, b, e, cost});
+                    b = e;
+                }
+            });
+            std::sort(begin(tasks), end(tasks), [](Task const & a, Task const & b) { return a.cost > b.cost; });
+
+            size_t seedPairs = 0;
+            for (auto const & t : tasks)
+                seedPairs += t.cost;
+            if (adaptive && seedPairs > Board::sweepSeedPairs)
+                return findBySweep<N>(ctx, board, stats, nThreads, cleared, cancel);
+        }
+
+        // Each worker finds pairs into its own set. Every seed in a region yields the same pairs, so the merged sets are
+        // the same however the tasks are divided.
+        struct Worker {
+            FlatHashSet<Visit, VisitHash> visited;
+            Pairs result;
+            std::vector<Growth> stack;
+            Board::Stats stats;
+
+            void reset() {
+                visited.clear();
+                result.clear();
+                stats = Board::Stats{0, 0, 0, 0};
+            }
+        };
+        static ScratchPool<Worker> pool;
+        auto workers = takeWorkers(pool, nThreads, ctx.arena);
+        std::atomic<size_t> nextTask{0};
+
+        runWorkers(workers, [&](Worker & w) {
+            int & analyses = w.stats.analyses, & tests = w.stats.tests, & matches = w.stats.matches, & overlaps = w.stats.overlaps;
+
+            // Under sr, a seed can only grow within the connected region of cells whose colors agree with their images.
+            // If that region is disjoint from its image, the seed grows into that one pair and nothing else, so take
+            // it whole. Otherwise take the region's maximal disjoint subsets. Either way, every other seed in the
+            // region then lands on a visited region instead of working it out again.
+            auto analysePair = [&](std::array<BitBoard, 2> const & bbs, BitBoard::ShiftRotate const & sr) {
+                ++analyses;
+                auto inverse = sr.inverse();
+                auto agree = BitBoard::empty();
+                for (size_t c = 0; c < colorCount<N>(board); ++c)
+                    agree |= (inverse * board.colors[c]) & board.colors[c];
+                auto region = Connectivity::fill(bbs[0].ls1b(), agree);
+                auto image = sr * region;
+                std::array<BitBoard, 2> pair{{region, image}};
+                auto anchor = position(sr * region.ls1b());
+                bool disjoint = !(region & image);
+                if (disjoint && image < region) {
+                    std::swap(pair[0], pair[1]);
+                    anchor = position(inverse * image.ls1b());
+                }
+                if (!w.visited.insert(Visit{pair, anchor}).second)
+                    return;
+
+                auto found = [&](BitBoard const & a, BitBoard const & b) {
+                    ++matches;
+                    w.result.insert(a < b ? std::array<BitBoard, 2>{{a, b}} : std::array<BitBoard, 2>{{b, a}});
+                };
+                if (disjoint) {
+                    found(region, image);
+                    return;
+                }
+                ++overlaps;
+                forEachMaximalDisjoint(region, [&](BitBoard const & bb) { return sr * bb; }, [&](BitBoard const & bb) { return inverse * bb; },
+                                       w.stack, tests, [&](BitBoard const & a) { found(a, sr * a); });
+            };
+
+            for (size_t t; !cancelled(cancel) && (t = nextTask++) < tasks.size();) {
+                auto const & task = tasks[t];
+                for (auto bb0 = begin(task.set) + task.begin; bb0 != begin(task.set) + task.end && !cancelled(cancel); ++bb0)
+                    for (auto bb1 = bb0; ++bb1 != end(task.set);)
+                        if (!(bb0->bb & bb1->bb) && ((bb0->bb | bb1->bb) & near))
+                            analysePair({bb0->bb, bb1->bb}, bb1->sr * bb0->sr.inverse());
+            }
+        });
+
+        // A pair that is maximal under its own transform may still grow under another, so each is checked directly.
+        // With cleared cells, pairs away from them may not have been tried under every transform, so they aren't
+        // returned.
+        auto & result = ctx.pairs;
+        result.clear();
+        if (cancelled(cancel))
+            return;
+        result.reserve(workers[0]->result.size());
+        for (auto const & w : workers)
+            for (auto const & bbs : w->result)
+                if ((!cleared || ((bbs[0].nhood4() | bbs[1].nhood4()) & *cleared)) &&
+                    !growable<N>(board, mask, bbs[0], bbs[1]))
+                    result.insert(bbs);
+
+        sumStats(workers, stats);
+    }
+
+    // True iff a transform carries a onto b with agreeing colors and can grow them into a bigger pair.
+    template <size_t N>
+    bool growable(Board const & board, BitBoard const & mask, BitBoard const & a, BitBoard const & b) {
+        for (int k = 0; k < 4; ++k) {
+            auto ra = rotate(a, k);
+            int dx = ra.marginW() - b.marginW(), dy = ra.marginS() - b.marginS();
+            if (ra.shiftWS(dx, dy) != b)
+                continue;
+
+            auto forward = [&](BitBoard const & bb) { return rotate(bb, k).shiftWS(dx, dy); };
+            bool agree = true;
+            for (size_t c = 0; c < colorCount<N>(board) && agree; ++c)
+                agree = forward(board.colors[c] & a) == (board.colors[c] & b);
+            if (!agree)
+                continue;
+
+            for (auto hood = a.nhood4() & ~a & mask; hood;) {
+                auto p = hood.ls1b();
+                hood &= ~p;
+                auto q = forward(p);
+                if (q && !((a | p) & (b | q)) && sameColor<N>(board, p, q))
+                    return true;
+            }
+        }
         return false;
-    };
+    }
 
-    typedef std::vector<BitBoard::WithOrientation> TripleSet;
-    typedef std::unordered_map<size_t, TripleSet> TripleMap;
+    // Sweep every rotation and shift T. The cells whose color matches the color of their image under T form an
+    // agreement board, and each connected region R of it gives the maximal pair (R, T R), provided R and T R don't
+    // overlap. Overlapping regions give their maximal subsets that are disjoint from their images instead.
+    // Given cleared cells, only regions next to them (on either side of T) are explored, and only pairs next to them
+    // are kept. The pairs go into ctx.pairs.
+    template <size_t N>
+    void findBySweep(AnalysisContext & ctx, Board const & board, Board::Stats * stats, size_t nThreads, BitBoard const * cleared,
+                     Board::Cancel const * cancel) {
+        auto mask = maskOf<N>(board);
+        size_t const nColors = colorCount<N>(board);
+
+        // Each color plane in each orientation.
+        BitBoard rotated[4][Board::maxColors];
+        for (int k = 0; k < 4; ++k)
+            for (size_t c = 0; c < nColors; ++c)
+                rotated[k][c] = rotate(board.colors[c], k);
+
+        // One task per rotation and vertical shift.
+        struct Worker {
+            Pairs found;
+            std::vector<Growth> stack;
+            Board::Stats stats;
+
+            void reset() {
+                found.clear();
+                stats = Board::Stats{0, 0, 0, 0};
+            }
+        };
+        static ScratchPool<Worker> pool;
+        auto workers = takeWorkers(pool, nThreads, ctx.arena);
+        std::atomic<int> nextTask{0};
+
+        runWorkers(workers, [&](Worker & w) {
+            int & analyses = w.stats.analyses, & tests = w.stats.tests, & matches = w.stats.matches, & overlaps = w.stats.overlaps;
+
+            auto emit = [&](BitBoard const & a, BitBoard const & b) {
+                if (cleared && !((a.nhood4() | b.nhood4()) & *cleared))
+                    return;
+                ++matches;
+                w.found.insert(a < b ? std::array<BitBoard, 2>{{a, b}} : std::array<BitBoard, 2>{{b, a}});
+            };
+
+            for (int t; !cancelled(cancel) && (t = nextTask++) < 4 * 31;) {
+                int k = t / 31, dy = t % 31 - 15;
+                for (int dx = -15; dx <= 15; ++dx) {
+                    if (!k && !dx && !dy)
+                        continue;
+                    ++analyses;
+
+                    // T(bb) = rotate(bb, k).shiftWS(dx, dy). Agreement is computed on the image side.
+                    auto agree = BitBoard::empty();
+                    for (size_t c = 0; c < nColors; ++c)
+                        agree |= rotated[k][c].shiftWS(dx, dy) & board.colors[c];
+                    if (agree.count() < 3)
+                        continue;
+
+                    auto forward = [&](BitBoard const & bb) { return rotate(bb, k).shiftWS(dx, dy); };
+                    auto inverse = [&](BitBoard const & bb) { return rotate(bb.shiftWS(-dx, -dy), 4 - k); };
+
+                    auto live = agree;
+                    if (cleared) {
+                        auto hood = cleared->nhood4();
+                        live &= hood | forward(hood);
+                    }
 
-    auto enumerateTriples = [&](TripleMap const & m) {
-        for (auto const & i : m)
-            for (auto bb0 = std::begin(i.second); bb0 != end(i.second); ++bb0)
-                for (auto bb1 = bb0; ++bb1 != end(i.second);)
-                    analysePair({bb0->bb, bb1->bb}, bb1->sr * bb0->sr.inverse(), 3);
-    };
+                    while (live) {
+                        auto image = Connectivity::fill(live.ls1b(), agree);
+                        agree &= ~image;
+                        live &= ~image;
+                        if (image.count() < 3)
+                            continue;
+                        ++tests;
+
+                        auto region = inverse(image);
+                        if (!(region & image)) {
+                            emit(region, image);
+                            continue;
+                        }
 
-    // Straight triples
-    TripleMap s_triples(2 * 4 * 16 * 16);
-    BitBoard s3{7, 0, 0, 0};
-    for (int8_t r = 0; r < 4; ++r)
-        for (int8_t y = 0; y < 16; ++y)
-            for (int8_t x = 0; x < 14; ++x) {
-                int *c = rotcolors[r][y] + x;
-                char c0 = c[0], c1 = c[1], c2 = c[2];
-
-                if (~c0 && ~c1 && ~c2 &&    // no missing dots and ...
-                    c0 <= c2)               //   not greater of asymmetric pair
-                {
-                    s_triples[c0 + 5 * c1 + 25 * c2].push_back(BitBoard::ShiftRotate{{x, y}, static_cast<int8_t>(-r)}(s3));
+                        ++overlaps;
+                        forEachMaximalDisjoint(region, forward, inverse, w.stack, tests,
+                                               [&](BitBoard const & a) { emit(a, forward(a)); });
+                    }
                 }
             }
-    enumerateTriples(s_triples);
-
-    // L-triples
-    TripleMap l_triples(2 * 4 * 16 * 16);
-    BitBoard l3{3 + (1 << 16), 0, 0, 0};
-    for (int8_t r = 0; r < 4; ++r)
-        for (int8_t y = 0; y < 15; ++y)
-            for (int8_t x = 0; x < 14; ++x) {
-                int (&c)[16][16] = rotcolors[r];
-                char c0 = c[y + 1][x], c1 = c[y][x], c2 = c[y][x + 1];
-                if (~c0 && ~c1 && ~c2)
-                    l_triples[c0 + 5 * c1 + 25 * c2].push_back(BitBoard::ShiftRotate{{x, y}, static_cast<int8_t>(-r)}(l3));
+        });
+
+        auto & result = ctx.pairs;
+        result.clear();
+        if (cancelled(cancel))
+            return;
+        result.reserve(workers[0]->found.size());
+        for (auto const & w : workers)
+            result.insert(begin(w->found), end(w->found));
+
+        // A symmetric pair that is maximal under one transform may still grow under another.
+        for (auto i = begin(result); i != end(result);)
+            if (growable<N>(board, mask, (*i)[0], (*i)[1]))
+                i = result.erase(i);
+            else
+                ++i;
+
+        sumStats(workers, stats);
+    }
+
+    template <size_t N>
+    struct FindMatchingPairs {
+        static void run(AnalysisContext & ctx, Board const & board, Board::Stats * stats, size_t nThreads, Board::Engine engine,
+                        BitBoard const * cleared, Board::Cancel const * cancel) {
+            ctx.arena.reset();
+            switch (engine) {
+                case Board::Engine::sweep   : findBySweep  <N>(ctx, board, stats, nThreads, cleared, cancel); break;
+                case Board::Engine::adaptive: findByTriples<N>(ctx, board, stats, nThreads, cleared, cancel, true); break;
+                default                     : findByTriples<N>(ctx, board, stats, nThreads, cleared, cancel); break;
             }
-    enumerateTriples(l_triples);
-
-    auto smaller = [](TripleMap::value_type const & a, TripleMap::value_type const & b) { return a.second.size() < b.second.size(); };
-    auto const & largest = std::max(*std::max_element(begin(s_triples), end(s_triples), smaller),
-                                    *std::max_element(begin(l_triples), end(l_triples), smaller),
-                                    smaller);
-    std::cerr << "Largest triple set " << "RGBPY"[largest.first % 5] << "RGBPY"[(largest.first / 5) % 5] << "RGBPY"[largest.first / 25] << " has " << largest.second.size() << " elements\n";
-#if 0
-    std::cerr << analyses << " analyses; " << tests << " tests; " << matches << " matches; " << overlaps << " overlaps; " << result.size() << " returned; " << discarded.size() << " discarded\n";
+#ifdef METRICS
+            METRIC_HISTOGRAM("finder.pairs", ctx.pairs.size());
+            for (auto const & bbs : ctx.pairs)
+                METRIC_HISTOGRAM("finder.matchSize", bbs[0].count());
 #endif
-    
-    return result;
+        }
+    };
+
+    template <size_t N>
+    struct FindOtherMatches {
+        static std::vector<BitBoard> run(Board const & board, std::vector<BitBoard> const & matches) {
+            std::vector<BitBoard> result;
+
+            auto shape = matches[0].canonical();
+            BitBoard pattern[Board::maxColors];
+            for (size_t c = 0; c < colorCount<N>(board); ++c)
+                pattern[c] = (shape.sr * board.colors[c]) & shape.bb;
+
+            auto mask = maskOf<N>(board);
+            for (auto const & bb : matches)
+                mask &= ~bb;
+
+            size_t w = shape.bb.marginE(), h = shape.bb.marginN();
+            for (size_t r = 0; r < 4; ++r)
+                for (size_t y = 0; y < h; ++y)
+                    for (size_t x = 0; x < w; ++x) {
+                        BitBoard::ShiftRotate sr{{static_cast<signed char>(x), static_cast<signed char>(y)}, static_cast<int8_t>(r)};
+                        auto candidate = sr * shape.bb;
+                        if ((mask & candidate) != candidate)
+                            continue;
+                        auto inverse = sr.inverse();
+                        bool same = true;
+                        for (size_t c = 0; c < colorCount<N>(board) && same; ++c)
+                            same = inverse * (board.colors[c] & candidate) == pattern[c];
+                        if (same)
+                            result.push_back(candidate);
+                    }
+
+            return result;
+        }
+    };
+
 }
 
-std::vector<BitBoard> Board::findOtherMatches(std::vector<BitBoard> const & matches) const {
-    std::vector<BitBoard> result;
+size_t Board::sweepSeedPairs = 4000;
 
-    auto shape = matches[0].canonical();
-    auto pattern = (shape.sr * *this) & shape.bb;
+Board::Pairs Board::findMatchingPairs(Stats * stats, size_t nThreads, Engine engine, Cancel const * cancel) const {
+    MEMORY_SCOPE("Board::findMatchingPairs");
+    AnalysisContext ctx;
+    findMatchingPairs(ctx, stats, nThreads, engine, cancel);
+    return std::move(ctx.pairs);
+}
 
-    auto mask = computeMask();
-    for (auto const & bb : matches)
-        mask &= ~bb;
+Board::Pairs const & Board::findMatchingPairs(AnalysisContext & ctx, Stats * stats, size_t nThreads, Engine engine,
+                                              Cancel const * cancel) const {
+    MEMORY_SCOPE("Board::findMatchingPairs");
+    METRIC_SPAN("Board::findMatchingPairs");
+    TRACE_SPAN("Board::findMatchingPairs");
+    withColorCount<FindMatchingPairs>(ctx.colorLoops, nColors(), ctx, *this, stats, nThreads, engine,
+                                      static_cast<BitBoard const *>(nullptr), cancel);
+    return ctx.pairs;
+}
 
-    size_t w = shape.bb.marginE(), h = shape.bb.marginN();
-    for (size_t r = 0; r < 4; ++r)
-        for (size_t y = 0; y < h; ++y)
-            for (size_t x = 0; x < w; ++x) {
-                BitBoard::ShiftRotate sr{{static_cast<signed char>(x), static_cast<signed char>(y)}, static_cast<int8_t>(r)};
-                auto candidate = sr * shape.bb;
-                if ((mask & candidate) == candidate && sr.inverse() * (*this & candidate) == pattern)
-                    result.push_back(candidate);
-            }
+Board::Pairs Board::findMatchingPairsNear(BitBoard const & cleared, Stats * stats, size_t nThreads, Engine engine,
+                                          Cancel const * cancel) const {
+    MEMORY_SCOPE("Board::findMatchingPairsNear");
+    METRIC_SPAN("Board::findMatchingPairsNear");
+    TRACE_SPAN("Board::findMatchingPairsNear");
+    AnalysisContext ctx;
+    withColorCount<FindMatchingPairs>(ColorLoops::fixed, nColors(), ctx, *this, stats, nThreads, engine, &cleared, cancel);
+    return std::move(ctx.pairs);
+}
+
+BitBoard::ShiftRotate Board::transformOnto(BitBoard const & half, BitBoard const & other) const {
+    // Try each orientation of half that lands on other, keeping the one that lands every dot on its own color. A
+    // symmetric shape lands in more than one, and only the colors tell them apart.
+    auto back = toOrigin(other, 0).inverse();
+    for (int r = 0; r < 4; ++r) {
+        auto t = back * toOrigin(half, r);
+        bool lands = true;
+        forEachCell(half, [&](int c) {
+            int x = c & 15, y = c >> 4;
+            lands = lands && apply(t, x, y) && other.isSet(x, y) && color(x, y) == color(c & 15, c >> 4);
+        });
+        if (lands)
+            return t;
+    }
+    return BitBoard::ShiftRotate{{0, 0}, -1};
+}
 
-    return result;
+std::vector<BitBoard> Board::findOtherMatches(std::vector<BitBoard> const & matches, ColorLoops loops) const {
+    TRACE_SPAN("Board::findOtherMatches");
+    return withColorCount<FindOtherMatches>(loops, nColors(), *this, matches);
 }
 
 std::ostream& write(std::ostream& os, Board const & b, std::initializer_list<BitBoard> bbs, const char* colors, bool trimNorth) {
@@ -3,9 +3,13 @@
 
 #import <bricabrac/Math/BitBoard.h>
 
+#include "FlatHash.h"
+
 #include <utility>
 #include <algorithm>
 #include <numeric>
+#include <array>
+#include <atomic>
 #include <vector>
 #include <unordered_set>
 #include <iostream>
@@ -17,14 +21,62 @@ namespace std {
     template <>
     struct hash<std::array<brac::BitBoard, 2>> {
         size_t operator()(const std::array<brac::BitBoard, 2>& bb) const {
-            return hash<brac::BitBoard>()(bb[0])*1129803267 + hash<brac::BitBoard>()(bb[1]);
+            return hashWords({bb[0].a, bb[0].b, bb[0].c, bb[0].d, bb[1].a, bb[1].b, bb[1].c, bb[1].d});
         }
     };
 
 }
 
+class AnalysisContext;
+
+struct BitBoardHash {
+    size_t operator()(brac::BitBoard const & bb) const { return hashWords({bb.a, bb.b, bb.c, bb.d}); }
+};
+
+// Call f with the index, x + 16y, of each cell in bb, lowest first.
+template <typename F>
+void forEachCell(brac::BitBoard const & bb, F f) {
+    uint64_t const words[4] = {bb.a, bb.b, bb.c, bb.d};
+    for (int w = 0; w < 4; ++w)
+        for (uint64_t bits = words[w]; bits; bits &= bits - 1)
+            f(64 * w + __builtin_ctzll(bits));
+}
+
 struct Board {
-    std::vector<brac::BitBoard> colors;
+    typedef FlatHashSet<std::array<brac::BitBoard, 2>> Pairs;
+
+    enum { maxColors = 8 };
+
+    // Color planes, stored inline so that boards can be built and copied without touching the heap.
+    class Planes {
+    public:
+        explicit Planes(size_t n) : n_(static_cast<uint8_t>(n)) {
+            assert(n <= maxColors);
+            std::fill(planes_.begin(), planes_.end(), brac::BitBoard::empty());
+        }
+
+        size_t size () const { return n_; }
+        bool   empty() const { return !n_; }
+
+        brac::BitBoard       & operator[](size_t i)       { return planes_[i]; }
+        brac::BitBoard const & operator[](size_t i) const { return planes_[i]; }
+
+        brac::BitBoard       * begin()       { return planes_.data(); }
+        brac::BitBoard       * end  ()       { return planes_.data() + n_; }
+        brac::BitBoard const * begin() const { return planes_.data(); }
+        brac::BitBoard const * end  () const { return planes_.data() + n_; }
+
+        friend brac::BitBoard       * begin(Planes       & p) { return p.begin(); }
+        friend brac::BitBoard       * end  (Planes       & p) { return p.end  (); }
+        friend brac::BitBoard const * begin(Planes const & p) { return p.begin(); }
+        friend brac::BitBoard const * end  (Planes const & p) { return p.end  (); }
+
+    private:
+        std::array<brac::BitBoard, maxColors> planes_;
+        uint8_t n_;
+    };
+
+    Planes colors;
 
     Board(size_t n) : colors(n) { }
 
@@ -68,9 +120,9 @@ struct Board {
 
     Board BRAC_OPERATOR(~)() const { return map([&](brac::BitBoard const & color){ return ~color; }); }
 
-    Board& BRAC_OPERATOR(&=)(brac::BitBoard const & b) { return *this = *this & b; }
-    Board& BRAC_OPERATOR(|=)(brac::BitBoard const & b) { return *this = *this ^ b; }
-    Board& BRAC_OPERATOR(^=)(brac::BitBoard const & b) { return *this = *this | b; }
+    Board& BRAC_OPERATOR(&=)(brac::BitBoard const & b) { foreach([&](brac::BitBoard & color){ color &= b; }); return *this; }
+    Board& BRAC_OPERATOR(|=)(brac::BitBoard const & b) { foreach([&](brac::BitBoard & color){ color |= b; }); return *this; }
+    Board& BRAC_OPERATOR(^=)(brac::BitBoard const & b) { foreach([&](brac::BitBoard & color){ color ^= b; }); return *this; }
 
     void clear(int x, int y) {
         for (auto& c : colors)
@@ -96,7 +148,16 @@ struct Board {
         return map([=](brac::BitBoard const & b) { return b.shiftEN(e, n); });
     }
 
-    static bool selectionsMatch(Board const (&prerotated)[4], brac::BitBoard const & a, brac::BitBoard const & b);
+    // Which versions of the per-color loops the move finders and selectionsMatch() run: unrolled for boards of 2 to 5
+    // colors (see ColorCount.h), or the generic ones that other counts fall back to, for timing against them.
+    enum class ColorLoops { fixed, generic };
+
+    // True iff a and b have the same colors in some orientation. Uses a vector kernel where the CPU has one (AVX2,
+    // checked at run time, or NEON); selectionsMatchScalar() is the reference version.
+    static bool selectionsMatch(Board const (&prerotated)[4], brac::BitBoard const & a, brac::BitBoard const & b,
+                                ColorLoops loops = ColorLoops::fixed);
+    static bool selectionsMatchScalar(Board const (&prerotated)[4], brac::BitBoard const & a, brac::BitBoard const & b);
+    static char const * selectionsMatchKernel();
 
     template <typename I>
     bool selectionsMatch(I startBBs, I finishBBs) const {
@@ -105,9 +166,77 @@ struct Board {
         return std::all_of(++startBBs, finishBBs, [&](brac::BitBoard const & b) { return selectionsMatch(prerotated, a, b); });
     }
 
-    std::unordered_set<std::array<brac::BitBoard, 2>> findMatchingPairs() const;
+    // The transform that carries bb to the origin in orientation r, from bb's margins.
+    static brac::BitBoard::ShiftRotate toOrigin(brac::BitBoard const & bb, int r) {
+        auto m = [](int n) { return static_cast<int8_t>(n); };
+        int nm = bb.marginN(), sm = bb.marginS(), em = bb.marginE(), wm = bb.marginW();
+        switch (r) {
+            case 1 : return brac::BitBoard::ShiftRotate{{m(-wm), m( nm)}, 1};
+            case 2 : return brac::BitBoard::ShiftRotate{{m( em), m( nm)}, 2};
+            case 3 : return brac::BitBoard::ShiftRotate{{m( em), m(-sm)}, 3};
+            default: return brac::BitBoard::ShiftRotate{{m(-wm), m(-sm)}, 0};
+        }
+    }
+
+    // Where sr takes cell (x, y), as BitBoard applies it: shift, then turn the board. False if it leaves the board.
+    static bool apply(brac::BitBoard::ShiftRotate const & sr, int & x, int & y) {
+        x += sr.shift.x;
+        y += sr.shift.y;
+        if (x < 0 || x > 15 || y < 0 || y > 15)
+            return false;
+        int x0 = x;
+        switch (sr.rotation & 3) {
+            case 1 : x = 15 - y; y = x0;      break;
+            case 2 : x = 15 - x; y = 15 - y;  break;
+            case 3 : x = y;      y = 15 - x0; break;
+        }
+        return true;
+    }
+
+    // The transform that carries half onto other dot for dot, every dot landing on its own color, or one with a
+    // rotation of -1 if there is none. Worked out a cell at a time, which for a move's few cells beats turning boards.
+    brac::BitBoard::ShiftRotate transformOnto(brac::BitBoard const & half, brac::BitBoard const & other) const;
+
+    // Work done by one findMatchingPairs() call, summed over all threads. For the sweep engine, analyses counts
+    // transforms and tests counts regions. For both, overlaps counts regions that overlap their images and so had to
+    // be split, and each step of splitting one counts as a test.
+    struct Stats {
+        int analyses, tests, matches, overlaps;
+    };
+
+    // Move finders. All return the same pairs.
+    enum class Engine {
+        triples,    // Grow pairs of like-colored triples.
+        sweep,      // Sweep every transform for regions whose colors agree with their image.
+        adaptive,   // Triples, unless they would seed more than sweepSeedPairs pairs (few colors, big uniform regions).
+    };
+
+    // Roughly the number of seed pairs the triples engine grows in the time a sweep takes.
+    static size_t sweepSeedPairs;
+
+    // Set from another thread to abandon a search. The finders check it between seed pairs (or transforms) and return
+    // no pairs once it is set.
+    typedef std::atomic<bool> Cancel;
+
+    // Find every maximal matching pair: a pair of disjoint, connected shapes of at least three dots, related by a
+    // rotation and shift under which their colors agree, which no such transform can grow by another dot. With
+    // nThreads > 1, the work is divided into that many shards, run on Executor::shared() at the caller's priority; the
+    // result is the same either way.
+    Pairs findMatchingPairs(Stats * stats = nullptr, size_t nThreads = 1, Engine engine = Engine::adaptive,
+                            Cancel const * cancel = nullptr) const;
+
+    // The same, into ctx.pairs. The search's temporaries come from ctx, so once ctx has searched a board like this one,
+    // searching again allocates nothing (with nThreads = 1; more threads cost a queued job each).
+    Pairs const & findMatchingPairs(AnalysisContext & ctx, Stats * stats = nullptr, size_t nThreads = 1,
+                                    Engine engine = Engine::adaptive, Cancel const * cancel = nullptr) const;
+
+    // The maximal matching pairs with a shape next to a cell of cleared, which must be empty on this board. Clearing
+    // cells can't make a pair growable, so these are the only pairs that clearing them can add.
+    Pairs findMatchingPairsNear(brac::BitBoard const & cleared, Stats * stats = nullptr, size_t nThreads = 1,
+                                Engine engine = Engine::adaptive, Cancel const * cancel = nullptr) const;
 
-    std::vector<brac::BitBoard> findOtherMatches(std::vector<brac::BitBoard> const & matches) const;
+    std::vector<brac::BitBoard> findOtherMatches(std::vector<brac::BitBoard> const & matches,
+                                                 ColorLoops loops = ColorLoops::fixed) const;
 };
 
 inline Board operator*(brac::BitBoard::ShiftRotate const & sr, Board const & b) {
@@ -0,0 +1,33 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__ColorCount_h
+#define INCLUDED__ColorCount_h
+
+#include "Board.h"
+
+#include <utility>
+#include <cassert>
+
+// Per-color loops in the move finder run to colorCount<N>(board). For the color counts the game ships (2 to 5), N is
+// that count, fixed at compile time so that the loops unroll; N = 0 is the generic version, for any count.
+template <size_t N>
+size_t colorCount(Board const & board) {
+    assert(!N || N == board.nColors());
+    return N ? N : board.nColors();
+}
+
+// F<N>::run(args...) with N chosen for a board of n colors, or 0 if loops asks for the generic version. Dispatch once,
+// at the top of a search, so that everything under it is specialized.
+template <template <size_t> class F, typename... Args>
+auto withColorCount(Board::ColorLoops loops, size_t n, Args &&... args) -> decltype(F<0>::run(std::forward<Args>(args)...)) {
+    if (loops == Board::ColorLoops::fixed)
+        switch (n) {
+            case 2: return F<2>::run(std::forward<Args>(args)...);
+            case 3: return F<3>::run(std::forward<Args>(args)...);
+            case 4: return F<4>::run(std::forward<Args>(args)...);
+            case 5: return F<5>::run(std::forward<Args>(args)...);
+        }
+    return F<0>::run(std::forward<Args>(args)...);
+}
+
+#endif // INCLUDED__ColorCount_h
@@ -0,0 +1,98 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#include "Connectivity.h"
+
+#include <algorithm>
+#include <array>
+
+using namespace brac;
+
+namespace {
+
+    // Cell i's neighbour in direction d (W, E, S, N), or -1 off the board.
+    int neighbour(int i, int d) {
+        switch (d) {
+            case 0 : return i & 15 ? i - 1 : -1;
+            case 1 : return (i & 15) != 15 ? i + 1 : -1;
+            case 2 : return i >= 16 ? i - 16 : -1;
+            default: return i < 240 ? i + 16 : -1;
+        }
+    }
+
+    bool isSet(uint64_t const (&words)[4], int i) {
+        return words[i >> 6] >> (i & 63) & 1;
+    }
+
+    // The articulation points of the region holding cell root, by Tarjan's lowpoint walk, kept on an explicit stack.
+    // Returns them and sets reached to the region.
+    BitBoard articulations(uint64_t const (&words)[4], int root, BitBoard & reached) {
+        struct Frame {
+            uint8_t cell, parent, next;     // next: the direction to look in next.
+        };
+        std::array<uint16_t, 256> order{}, low;     // order: when each cell was reached, from 1; 0 if not yet.
+        std::array<Frame, 256> stack;
+        size_t depth = 0;
+        uint16_t time = 0;
+        int rootChildren = 0;
+        auto cuts = BitBoard::empty();
+
+        order[root] = low[root] = ++time;
+        stack[depth++] = Frame{uint8_t(root), uint8_t(root), 0};
+        while (depth) {
+            auto & f = stack[depth - 1];
+            int c = f.cell;
+            if (f.next < 4) {
+                int n = neighbour(c, f.next++);
+                if (n < 0 || !isSet(words, n))
+                    continue;
+                if (!order[n]) {
+                    order[n] = low[n] = ++time;
+                    rootChildren += c == root;
+                    stack[depth++] = Frame{uint8_t(n), uint8_t(c), 0};
+                } else if (n != f.parent) {
+                    low[c] = std::min(low[c], order[n]);
+                }
+            } else {
+                reached.set(c & 15, c >> 4);
+                int p = f.parent;
+                if (--depth) {
+                    low[p] = std::min(low[p], low[c]);
+                    if (p != root && low[c] >= order[p])
+                        cuts.set(p & 15, p >> 4);
+                }
+            }
+        }
+        if (rootChildren > 1)
+            cuts.set(root & 15, root >> 4);
+        return cuts;
+    }
+
+}
+
+namespace Connectivity {
+
+    BitBoard cutCells(BitBoard const & region) {
+        if (!region)
+            return region;
+        uint64_t const words[4] = {region.a, region.b, region.c, region.d};
+        int w = 0;
+        while (!words[w])
+            ++w;
+
+        auto reached = BitBoard::empty();
+        auto cuts = articulations(words, 64 * w + __builtin_ctzll(words[w]), reached);
+        if (reached == region)
+            return cuts;
+
+        // Already in pieces, so taking any cell leaves it split, unless there are only two and the cell is one of them
+        // on its own.
+        auto rest = region & ~reached;
+        cuts = region;
+        if (connected(rest))
+            for (auto const & piece : {reached, rest})
+                if (piece.count() == 1)
+                    cuts &= ~piece;
+        return cuts;
+    }
+
+}
@@ -0,0 +1,56 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__Connectivity_h
+#define INCLUDED__Connectivity_h
+
+#include <bricabrac/Math/BitBoard.h>
+
+#include <cstdint>
+
+// 4-connected regions of a BitBoard, worked on a whole board at a time: a region grows by shifting all of its cells
+// at once, rather than visiting them one by one.
+namespace Connectivity {
+
+    // bb with every cell's four neighbours added. The board's words hold four 16-cell rows each, so east and west are
+    // one-bit shifts that mustn't wrap into the next row, and north and south are 16-bit shifts that carry across words.
+    inline brac::BitBoard dilate(brac::BitBoard const & bb) {
+        uint64_t const col0 = 0x0001000100010001ULL, col15 = col0 << 15;
+        auto spread = [&](uint64_t w, uint64_t below, uint64_t above) {
+            return w | (w << 1 & ~col0) | (w >> 1 & ~col15) | w << 16 | below >> 48 | w >> 16 | above << 48;
+        };
+        return brac::BitBoard{spread(bb.a, 0, bb.b), spread(bb.b, bb.a, bb.c), spread(bb.c, bb.b, bb.d), spread(bb.d, bb.c, 0)};
+    }
+
+    // The cells of within connected to seed's, as brac::floodFill() finds them. Only the newly reached cells are grown
+    // each round, and it stops as soon as a round reaches nothing or the whole of within is taken.
+    inline brac::BitBoard fill(brac::BitBoard const & seed, brac::BitBoard const & within) {
+        auto region = seed & within;
+        for (auto frontier = region; frontier && region != within;) {
+            frontier = dilate(frontier) & within & ~region;
+            region |= frontier;
+        }
+        return region;
+    }
+
+    // Whether bb is a single region. The empty board counts as one.
+    inline bool connected(brac::BitBoard const & bb) {
+        return fill(bb.ls1b(), bb) == bb;
+    }
+
+    // Call f with each region of bb, in order of their lowest cells.
+    template <typename F>
+    void forEachComponent(brac::BitBoard bb, F f) {
+        while (bb) {
+            auto component = fill(bb.ls1b(), bb);
+            bb &= ~component;
+            f(component);
+        }
+    }
+
+    // The cells of region without which what's left of it would not be connected: its articulation points, found in one
+    // depth-first walk. Ask once per region, and each "would removing p split it?" is then just cutCells & p.
+    brac::BitBoard cutCells(brac::BitBoard const & region);
+
+}
+
+#endif // INCLUDED__Connectivity_h
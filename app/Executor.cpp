@@ -0,0 +1,117 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#include "Executor.h"
+
+#include <atomic>
+#include <memory>
+
+#if defined(__APPLE__)
+#include <pthread.h>
+#include <sys/qos.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+    // The priority of the job this thread is running.
+    thread_local Executor::Priority running = Executor::normal;
+
+    // Drop this thread below normal OS priority, for good: an unprivileged thread can't raise its nice value back.
+    void runInBackground() {
+#if defined(__APPLE__)
+        pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#elif defined(__linux__)
+        setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 10);
+#endif
+    }
+
+    // One forEach() call. Helpers that start after every index has been claimed find nothing to do, so the batch
+    // only has to outlive them, not f.
+    struct Batch {
+        std::atomic<size_t> next{0};
+        size_t n, done = 0;
+        std::function<void(size_t)> const * f;
+        std::mutex mutex;
+        std::condition_variable finished;
+
+        void work() {
+            size_t count = 0;
+            for (size_t i; (i = next++) < n; ++count)
+                (*f)(i);
+            if (count) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done += count;
+                if (done == n)
+                    finished.notify_all();
+            }
+        }
+    };
+
+}
+
+Executor::Executor(size_t nThreads, ThreadClass threadClass) {
+    for (size_t i = 0; i < std::max<size_t>(nThreads, 1); ++i)
+        threads_.emplace_back([=]{ run(threadClass); });
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto & t : threads_)
+        t.join();
+}
+
+void Executor::submit(Priority priority, std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queues_[priority].push_back(std::move(job));
+    }
+    wake_.notify_one();
+}
+
+void Executor::forEach(size_t n, std::function<void(size_t)> const & f) {
+    auto batch = std::make_shared<Batch>();
+    batch->n = n;
+    batch->f = &f;
+    for (size_t i = 1; i < n; ++i)
+        submit(running, [batch]{ batch->work(); });
+    batch->work();
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->finished.wait(lock, [&]{ return batch->done == n; });
+}
+
+Executor & Executor::shared() {
+    static Executor executor(std::max(std::thread::hardware_concurrency(), 2u) - 1, background);
+    return executor;
+}
+
+void Executor::run(ThreadClass threadClass) {
+    if (threadClass == background)
+        runInBackground();
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto next = [&]{
+                for (int p = nPriorities; p--;)
+                    if (!queues_[p].empty())
+                        return &queues_[p];
+                return static_cast<std::deque<std::function<void()>> *>(nullptr);
+            };
+            wake_.wait(lock, [&]{ return stopping_ || next(); });
+            if (stopping_)
+                return;
+            auto queue = next();
+            running = Priority(queue - &queues_[0]);
+            job = std::move(queue->front());
+            queue->pop_front();
+        }
+        job();
+    }
+}
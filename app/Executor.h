@@ -0,0 +1,58 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__Executor_h
+#define INCLUDED__Executor_h
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed pool of threads that runs jobs in priority order: a queued high-priority job always starts before a
+// low-priority one, and jobs of the same priority start in the order they were submitted. Built on std::thread, so it
+// runs the same under the app (alongside GCD) as in the headless benchmark.
+//
+// Priority only orders a pool's own queue. How hard its threads compete with the rest of the process is set per pool:
+// a background pool's threads run below normal OS priority (the utility QoS class on Apple platforms, a raised nice
+// value elsewhere), so the UI and render threads preempt them.
+class Executor {
+public:
+    enum Priority { low, normal, high, nPriorities };
+    enum ThreadClass { foreground, background };
+
+    explicit Executor(size_t nThreads = std::max(std::thread::hardware_concurrency(), 1u), ThreadClass threadClass = foreground);
+
+    // Jobs already running finish; jobs still queued are dropped.
+    ~Executor();
+
+    Executor(Executor const &) = delete;
+    Executor & operator=(Executor const &) = delete;
+
+    void submit(Priority priority, std::function<void()> job);
+
+    // Call f(i) for each i in [0, n), spread over the pool, and return once they have all returned. The caller takes
+    // a share of the calls rather than waiting idle, so this can't deadlock when called from a job, even with every
+    // thread busy. The shares queue at the priority of the job that calls this, or at normal from outside the pool.
+    void forEach(size_t n, std::function<void(size_t)> const & f);
+
+    size_t nThreads() const { return threads_.size(); }
+
+    // The pool that background game analysis runs on, created on first use: a background pool with a thread fewer than
+    // there are cores, so that one is always left for the UI.
+    static Executor & shared();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::array<std::deque<std::function<void()>>, nPriorities> queues_;
+    std::vector<std::thread> threads_;
+    bool stopping_ = false;
+
+    void run(ThreadClass threadClass);
+};
+
+#endif // INCLUDED__Executor_h
@@ -0,0 +1,267 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__FlatHash_h
+#define INCLUDED__FlatHash_h
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Mix a run of 64-bit words into a hash. Every input bit reaches every output bit, so keys that differ only in one
+// word (e.g., shapes in the same rows) still spread evenly.
+inline size_t hashWords(std::initializer_list<uint64_t> words) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (auto w : words) {
+        h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+    }
+    h *= 0x94d049bb133111ebULL;
+    return static_cast<size_t>(h ^ (h >> 29));
+}
+
+namespace detail {
+
+    // Open-addressing table with entries stored inline. Each slot has a control byte that is either empty, deleted, or
+    // the low seven bits of the entry's hash. Lookups load eight control bytes at once and compare all of them against
+    // the tag in a few word operations, so most probes read one group of metadata and compare one key. clear() keeps
+    // the capacity, so a table that is reused across calls stops allocating once it has grown to size.
+    template <typename Entry, typename Key, typename KeyOf, typename Hash, typename Eq>
+    class FlatTable {
+        enum : uint8_t { vacant = 0x80, tombstone = 0xfe };
+        enum : uint64_t { lsbs = 0x0101010101010101ULL, msbs = 0x8080808080808080ULL };
+
+    public:
+        class const_iterator {
+        public:
+            typedef std::forward_iterator_tag   iterator_category;
+            typedef Entry                       value_type;
+            typedef std::ptrdiff_t              difference_type;
+            typedef Entry const *               pointer;
+            typedef Entry const &               reference;
+
+            const_iterator() : t_(nullptr), i_(0) { }
+            const_iterator(FlatTable const * t, size_t i) : t_(t), i_(i) { skip(); }
+
+            Entry const & operator*() const { return t_->slots_[i_]; }
+            Entry const * operator->() const { return &t_->slots_[i_]; }
+
+            const_iterator & operator++() { ++i_; skip(); return *this; }
+            const_iterator operator++(int) { auto i = *this; ++*this; return i; }
+
+            bool operator==(const_iterator const & i) const { return i_ == i.i_; }
+            bool operator!=(const_iterator const & i) const { return i_ != i.i_; }
+
+        private:
+            friend class FlatTable;
+
+            FlatTable const * t_;
+            size_t i_;
+
+            void skip() { while (i_ < t_->ctrl_.size() && (t_->ctrl_[i_] & 0x80)) ++i_; }
+        };
+
+        class iterator : public const_iterator {
+        public:
+            iterator() { }
+            iterator(FlatTable * t, size_t i) : const_iterator(t, i) { }
+
+            Entry & operator*() const { return const_cast<Entry &>(const_iterator::operator*()); }
+            Entry * operator->() const { return &**this; }
+
+            iterator & operator++() { const_iterator::operator++(); return *this; }
+            iterator operator++(int) { auto i = *this; ++*this; return i; }
+        };
+
+        FlatTable() { }
+
+        size_t size    () const { return size_; }
+        bool   empty   () const { return !size_; }
+        size_t capacity() const { return ctrl_.size(); }
+
+        iterator        begin()       { return {this, 0}; }
+        iterator        end  ()       { return {this, ctrl_.size()}; }
+        const_iterator  begin() const { return {this, 0}; }
+        const_iterator  end  () const { return {this, ctrl_.size()}; }
+
+        void clear() {
+            if (size_ + deleted_) {
+                if (!std::is_trivially_destructible<Entry>::value)
+                    for (size_t i = 0; i < ctrl_.size(); ++i)
+                        if (!(ctrl_[i] & 0x80))
+                            slots_[i] = Entry();
+                std::fill(ctrl_.begin(), ctrl_.end(), uint8_t(vacant));
+                size_ = deleted_ = 0;
+            }
+        }
+
+        void reserve(size_t n) {
+            size_t cap = 8;
+            while (cap - cap / 8 < n)
+                cap *= 2;
+            if (cap > ctrl_.size())
+                rehash(cap);
+        }
+
+        const_iterator find(Key const & key) const { return {this, lookup(key)}; }
+        iterator       find(Key const & key)       { return {this, lookup(key)}; }
+
+        size_t count(Key const & key) const { return lookup(key) != ctrl_.size(); }
+
+        size_t erase(Key const & key) {
+            size_t i = lookup(key);
+            if (i == ctrl_.size())
+                return 0;
+            eraseAt(i);
+            return 1;
+        }
+
+        iterator erase(const_iterator i) {
+            eraseAt(i.i_);
+            return {this, i.i_ + 1};
+        }
+
+    protected:
+        template <typename E>
+        std::pair<iterator, bool> insertEntry(Key const & key, E && entry) {
+            size_t h = Hash()(key);
+            size_t i = lookup(key, h);
+            if (i != ctrl_.size())
+                return {{this, i}, false};
+            if ((size_ + deleted_ + 1) * 8 > ctrl_.size() * 7)   // Grow, unless it's mostly tombstones.
+                rehash((size_ + 1) * 2 > ctrl_.size() ? std::max<size_t>(ctrl_.size() * 2, 8) : ctrl_.size());
+            i = vacancy(h);
+            deleted_ -= ctrl_[i] == tombstone;
+            ctrl_[i] = tag(h);
+            slots_[i] = std::forward<E>(entry);
+            ++size_;
+            return {{this, i}, true};
+        }
+
+    private:
+        std::vector<uint8_t> ctrl_;
+        std::vector<Entry> slots_;
+        size_t size_ = 0, deleted_ = 0;
+
+        static uint8_t tag(size_t h) { return static_cast<uint8_t>(h >> (8 * sizeof(size_t) - 7)); }
+
+        // Control bytes of the group starting at i, byte j in bits 8j..8j+7. Capacities are powers of two, at least
+        // eight, so groups never straddle the end.
+        uint64_t group(size_t i) const {
+            uint64_t g = 0;
+            for (size_t j = 8; j--;)
+                g = (g << 8) | ctrl_[i + j];
+            return g;
+        }
+
+        // High bit of every byte of g that might equal t. False positives are possible; callers check.
+        static uint64_t matches(uint64_t g, uint8_t t) {
+            uint64_t x = g ^ (lsbs * t);
+            return (x - lsbs) & ~x & msbs;
+        }
+
+        // High bit of every empty byte of g (0x80 has bit 1 clear; deleted, 0xfe, doesn't).
+        static uint64_t empties(uint64_t g) { return g & ~(g << 6) & msbs; }
+
+        static size_t lowest(uint64_t bits) { return __builtin_ctzll(bits) / 8; }
+
+        size_t lookup(Key const & key) const { return lookup(key, Hash()(key)); }
+
+        size_t lookup(Key const & key, size_t h) const {
+            size_t n = ctrl_.size();
+            if (!n)
+                return 0;
+            uint8_t t = tag(h);
+            for (size_t g = h & (n - 1) & ~size_t(7), probes = 0; probes < n; g = (g + 8) & (n - 1), probes += 8) {
+                uint64_t word = group(g);
+                for (uint64_t m = matches(word, t); m; m &= m - 1) {
+                    size_t i = g + lowest(m);
+                    if (ctrl_[i] == t && Eq()(KeyOf()(slots_[i]), key))
+                        return i;
+                }
+                if (empties(word))
+                    break;
+            }
+            return n;
+        }
+
+        // The first empty or deleted slot on h's probe sequence.
+        size_t vacancy(size_t h) const {
+            size_t n = ctrl_.size();
+            for (size_t g = h & (n - 1) & ~size_t(7);; g = (g + 8) & (n - 1))
+                if (uint64_t m = group(g) & msbs)
+                    return g + lowest(m);
+        }
+
+        void eraseAt(size_t i) {
+            ctrl_[i] = tombstone;
+            if (!std::is_trivially_destructible<Entry>::value)
+                slots_[i] = Entry();
+            --size_;
+            ++deleted_;
+        }
+
+        void rehash(size_t cap) {
+            std::vector<uint8_t> ctrl(cap, uint8_t(vacant));
+            std::vector<Entry> slots(cap);
+            ctrl.swap(ctrl_);
+            slots.swap(slots_);
+            deleted_ = 0;
+            for (size_t i = 0; i < ctrl.size(); ++i)
+                if (!(ctrl[i] & 0x80)) {
+                    size_t h = Hash()(KeyOf()(slots[i]));
+                    size_t j = vacancy(h);
+                    ctrl_[j] = tag(h);
+                    slots_[j] = std::move(slots[i]);
+                }
+        }
+    };
+
+    struct Identity {
+        template <typename T> T const & operator()(T const & t) const { return t; }
+    };
+
+    struct First {
+        template <typename T> typename T::first_type const & operator()(T const & t) const { return t.first; }
+    };
+
+}
+
+template <typename Key, typename Hash = std::hash<Key>, typename Eq = std::equal_to<Key>>
+class FlatHashSet : public detail::FlatTable<Key, Key, detail::Identity, Hash, Eq> {
+public:
+    typedef Key value_type;
+
+    FlatHashSet() { }
+
+    template <typename I>
+    FlatHashSet(I first, I last) { insert(first, last); }
+
+    std::pair<typename FlatHashSet::iterator, bool> insert(Key const & key) { return this->insertEntry(key, key); }
+
+    template <typename I>
+    void insert(I first, I last) {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+
+    bool operator==(FlatHashSet const & s) const {
+        return this->size() == s.size() && std::all_of(this->begin(), this->end(), [&](Key const & k) { return s.count(k); });
+    }
+    bool operator!=(FlatHashSet const & s) const { return !(*this == s); }
+};
+
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename Eq = std::equal_to<Key>>
+class FlatHashMap : public detail::FlatTable<std::pair<Key, Value>, Key, detail::First, Hash, Eq> {
+public:
+    typedef std::pair<Key, Value> value_type;
+
+    Value & operator[](Key const & key) { return this->insertEntry(key, value_type{key, Value()}).first->second; }
+};
+
+#endif // INCLUDED__FlatHash_h
@@ -2,6 +2,10 @@
 
 #include "GameRenderer.h"
 #include "GameView.h"
+#include "MemoryProfile.h"
+#include "Metrics.h"
+#include "SelectionBorder.h"
+#include "Trace.h"
 
 #include <bricabrac/Math/MathUtil.h>
 #include <bricabrac/Texture/Texture.h>
@@ -48,7 +52,14 @@ static brac::vec2 white  {0.5 , 0.75};
 static brac::vec2 yellow {0.75, 0.75};
 static brac::vec2 black  {0   , 0.25};
 
-typedef std::unordered_map<size_t, BorderVertexBuffer> Borders;
+// A selection's border, and whether to draw it dimmed: too small to match, or held by no move, so the player sees a
+// dead end as soon as they draw into one.
+struct Border {
+    BorderVertexBuffer vbo;
+    bool dim;
+};
+
+typedef std::unordered_map<size_t, Border> Borders;
 
 struct RgbaPixel {
     GLubyte r, g, b, a;
@@ -81,80 +92,26 @@ struct GameRenderer::Members {
     float hintIntensity = 0;
     std::array<BorderVertexBuffer, 2> vboHints;
 
-    Members(std::shared_ptr<GameView> const & game, size_t colorSet) : gameView(game), colorSet(colorSet) { }
-
-    std::vector<BorderVertex> prepareSelectionBorder(brac::BitBoard const & bb) {
-        std::vector<BorderVertex> border;
-
-        vec2 Ci{0, 0}, I{0.25, 0.25}, Cs{0.25, 0}, S{0.5, 0.25}, Co{0.5, 0}, O{0.75, 0.25};
-        vec2 texcoords[] = {Cs, O, S, I, I};
-
-        enum CornerType { none, outer, straight, inner, own_inner };
-        auto cornerType = [](bool cw, bool diag, bool ccw) {
-            switch (cw + 2*diag + 4*ccw) {
-                case 0 : return outer;
-                case 1 : return straight;
-                case 2 : return outer;
-                case 3 : return inner;
-                case 4 : return straight;
-                case 5 : return own_inner;
-                case 6 : return inner;
-                default: return none;
-            }
-        };
+    // Room for a border around every cell, so that prepareSelectionBorder() never reallocates it.
+    std::vector<BorderVertex> borderVertices;
 
-        auto triangle = [&](vec2 a, vec2 b, vec2 c, CornerType edge, CornerType corner) {
-            BorderVertex vs[] = {
-                {a, corner == own_inner && edge == none ? Ci : Co},
-                {b, texcoords[edge]},
-                {c, texcoords[corner]},
-            };
-            if (cross(b, c) < 0)
-                std::swap(vs[1], vs[2]);
-            border.insert(end(border), std::begin(vs), std::end(vs));
-        };
+    Members(std::shared_ptr<GameView> const & game, size_t colorSet) : gameView(game), colorSet(colorSet) {
+        borderVertices.reserve(SelectionBorder::verticesPerCell * 16 * 16);
+    }
 
-        for (int y = 0; y < nBoardRows; ++y)
-            for (int x = 0; x < nBoardCols; ++x) {
-                vec2 c{0.5f + x, 0.5f + y};
-                uint64_t hood = bb.shiftWS(x - 1, y - 1).a;
-                if (hood & (2ULL<<16)) {
-                    bool SW = hood &  1ULL;
-                    bool S  = hood &  2ULL;
-                    bool SE = hood &  4ULL;
-                    bool W  = hood & (1ULL<<16);
-                    bool E  = hood & (4ULL<<16);
-                    bool NW = hood & (1ULL<<32);
-                    bool N  = hood & (2ULL<<32);
-                    bool NE = hood & (4ULL<<32);
-                    CornerType SWc = cornerType(W, SW, S);
-                    CornerType SEc = cornerType(S, SE, E);
-                    CornerType NEc = cornerType(E, NE, N);
-                    CornerType NWc = cornerType(N, NW, W);
-
-                    // Edge types
-                    CornerType Ne = N ? none : straight;
-                    CornerType Se = S ? none : straight;
-                    CornerType Ee = E ? none : straight;
-                    CornerType We = W ? none : straight;
-
-                    triangle(c, c + vec2{-0.5,  0   }, c + vec2{-0.5, -0.5}, We, SWc);
-                    triangle(c, c + vec2{-0.5,  0   }, c + vec2{-0.5,  0.5}, We, NWc);
-                    triangle(c, c + vec2{ 0   , -0.5}, c + vec2{ 0.5, -0.5}, Se, SEc);
-                    triangle(c, c + vec2{ 0   , -0.5}, c + vec2{-0.5, -0.5}, Se, SWc);
-                    triangle(c, c + vec2{ 0.5,  0   }, c + vec2{ 0.5, -0.5}, Ee, SEc);
-                    triangle(c, c + vec2{ 0.5,  0   }, c + vec2{ 0.5,  0.5}, Ee, NEc);
-                    triangle(c, c + vec2{ 0   ,  0.5}, c + vec2{ 0.5,  0.5}, Ne, NEc);
-                    triangle(c, c + vec2{ 0   ,  0.5}, c + vec2{-0.5,  0.5}, Ne, NWc);
-                }
-            }
-        if (border.empty()) {
-            std::cerr << "Huh?\n";
-        }
-        return border;
+    // The mesh of a selection's border, in a buffer that is overwritten by the next call.
+    std::vector<BorderVertex> const & prepareSelectionBorder(brac::BitBoard const & bb) {
+        MEMORY_SCOPE("GameRenderer::Members::prepareSelectionBorder");
+        METRIC_SPAN("GameRenderer::Members::prepareSelectionBorder");
+        SelectionBorder::mesh(bb, borderVertices);
+        METRIC_HISTOGRAM("renderer.borderVertices", borderVertices.size());
+        if (borderVertices.empty())
+            METRIC_COUNT("renderer.emptyBorders", 1);
+        return borderVertices;
     }
 
     void updateDots() {
+        METRIC_SPAN("GameRenderer::Members::updateDots");
         if (gameView) {
             auto const & board = gameView->game()->board();
             int nCells = nBoardRows * nBoardCols;
@@ -211,30 +168,39 @@ void GameRenderer::setGameView(const std::shared_ptr<GameView> &gameView) {
     m->edgeThickness = gEdgeThickness * scale;
     m->viewHeight = m->nBoardRows + 2 * m->edgeThickness;
 
-    game->onSelectionChanged.connect([=]{
+    // Borders are only rebuilt as selections change, so none may linger from the last game.
+    m->borders.clear();
+
+    game->onSelectionChanged.connect([=](GameState::SelectionChanges const & changes) {
+        TRACE_SPAN("GameRenderer::onSelectionChanged");
         auto const & sels = game->sels();
 
-        // Remove deselected borders.
-        for (auto i = begin(m->borders); i != end(m->borders);) {
-            auto s = sels.find(i->first);
-            if (s != end(sels) && s->second.has_border()) {
-                ++i;
-            } else {
-                i = m->borders.erase(i);
+        // Rebuild only the borders of selections that changed, dropping those that are gone or have no border.
+        for (auto const & change : changes) {
+            auto sel = sels.find(change.index);
+            if (sel == end(sels) || !sel->second.has_border()) {
+                m->borders.erase(change.index);
+                continue;
             }
-        }
+            auto const & cells = sel->second.is_selected;
 
-        // Update modified borders and create new borders.
-        for (auto const & sel : sels)
-            if (sel.second.has_border()) {
-                auto verts = m->prepareSelectionBorder(sel.second.is_selected);
-                auto i = m->borders.find(sel.first);
-                if (i == end(m->borders)) {
-                    m->borders.emplace(sel.first, BorderVertexBuffer{verts});
-                } else {
-                    i->second.data(verts);
-                }
+            // GameState answered for changed selections before this fired, so this finds the answer cached. New moves
+            // reassess every selection, so a border drawn before they were known is dimmed once they are.
+            bool dim = game->hopeless(cells);
+
+            auto i = m->borders.find(change.index);
+            if (i != end(m->borders) && change.kind == GameState::SelectionChange::reassessed) {
+                i->second.dim = dim;
+                continue;
+            }
+            auto const & verts = m->prepareSelectionBorder(cells);
+            if (i == end(m->borders)) {
+                m->borders.emplace(change.index, Border{BorderVertexBuffer{verts}, dim});
+            } else {
+                i->second.vbo.data(verts);
+                i->second.dim = dim;
             }
+        }
 
         toRefreshScene();
     });
@@ -505,12 +471,13 @@ void GameRenderer::render() {
         auto & border = (*m->border)();
         border->pmvMat = m->pmvMatrix;
 
-        for (auto const & sel : m->gameView->game()->sels()) {
+        auto const & game = m->gameView->game();
+        for (auto const & sel : game->sels()) {
             auto b = m->borders.find(sel.first);
-            if (b != m->borders.end() && b->second) {
-                border->color = vec4{(vec3)selectionColors[sel.first % selectionColors.size()] * (1 - 0.5 * (sel.second.is_selected.count() < GameState::minimumSelection)), 1};
+            if (b != m->borders.end() && b->second.vbo) {
+                border->color = vec4{(vec3)selectionColors[sel.first % selectionColors.size()] * (1 - 0.5 * b->second.dim), 1};
 
-                b->second.render(border, GL_TRIANGLES);
+                b->second.vbo.render(border, GL_TRIANGLES);
             }
         }
 
@@ -1,6 +1,10 @@
 //  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
 
 #include "GameState.h"
+#include "Connectivity.h"
+#include "MemoryProfile.h"
+#include "Metrics.h"
+#include "Trace.h"
 
 #include <bricabrac/Math/vec2.h>
 
@@ -8,20 +12,153 @@
 #include <iostream>
 #include <sstream>
 #include <algorithm>
+#include <numeric>
 #include <random>
-
-#include <mach/mach_time.h>
+#include <mutex>
+#include <stdexcept>
 
 using namespace brac;
 
-GameState::GameState(size_t nColors, size_t width, size_t height, size_t * seed) : board_(nColors), width_(width), height_(height) {
-    for (size_t i = 0; i < 256 / 3 + 1; ++i)
-        indices_.insert(i);
+GameState::Selections::Selections() {
+    for (size_t i = 0; i < capacity; ++i)
+        slots_[i].first = i;
+    owners_.fill(none);
+}
+
+GameState::Selection const & GameState::Selections::at(size_t index) const {
+    if (!isUsed(index))
+        throw std::out_of_range("GameState::Selections::at");
+    return slots_[index].second;
+}
+
+size_t GameState::Selections::next(size_t index) const {
+    for (size_t w = index >> 6; w < 2; ++w)
+        if (uint64_t bits = used_[w] & ~0ULL << (index > 64 * w ? index - 64 * w : 0))
+            return 64 * w + __builtin_ctzll(bits);
+    return capacity;
+}
+
+size_t GameState::Selections::lowestFree() const {
+    if (uint64_t free = ~used_[0])
+        return __builtin_ctzll(free);
+    if (uint64_t free = ~used_[1] & ((1ULL << (capacity - 64)) - 1))
+        return 64 + __builtin_ctzll(free);
+    return capacity;
+}
+
+GameState::Selections::iterator GameState::Selections::emplace(size_t index) {
+    // Start afresh, but keep added's buffer for the next selection to use this slot.
+    auto & sel = slots_[index].second;
+    auto added = std::move(sel.added);
+    sel = Selection{};
+    sel.added = std::move(added);
+    sel.added.clear();
+    used_[index >> 6] |= 1ULL << (index & 63);
+    return {this, index};
+}
+
+void GameState::Selections::erase(iterator sel) {
+    select(sel, BitBoard::empty());
+    setKey(sel, nullptr);
+    used_[sel.i_ >> 6] &= ~(1ULL << (sel.i_ & 63));
+}
+
+void GameState::Selections::clear() {
+    used_[0] = used_[1] = 0;
+    cutsKnown_[0] = cutsKnown_[1] = 0;
+    owners_.fill(none);
+    shared_ = BitBoard::empty();
+    nKeys_ = 0;
+}
+
+GameState::Selections::iterator GameState::Selections::owner(BitBoard const & cell) {
+    uint64_t const words[4] = {cell.a, cell.b, cell.c, cell.d};
+    for (int w = 0; w < 4; ++w)
+        if (words[w]) {
+            auto o = owners_[64 * w + __builtin_ctzll(words[w])];
+            return {this, o == none ? size_t(capacity) : o};
+        }
+    return end();
+}
+
+GameState::Selections::iterator GameState::Selections::withKey(void const * key) {
+    for (size_t k = 0; k < nKeys_; ++k)
+        if (keys_[k].first == key)
+            return {this, keys_[k].second};
+    return end();
+}
+
+void GameState::Selections::setKey(iterator sel, void const * key) {
+    // Drop sel's old key, and take this one from any selection it was steering.
+    size_t n = 0;
+    for (size_t k = 0; k < nKeys_; ++k) {
+        auto const & e = keys_[k];
+        if (e.second == sel.i_)
+            continue;
+        if (key && e.first == key) {
+            slots_[e.second].second.key = nullptr;
+            continue;
+        }
+        keys_[n++] = e;
+    }
+    nKeys_ = n;
+    if (key)
+        keys_[nKeys_++] = {key, uint8_t(sel.i_)};
+    sel->second.key = key;
+}
 
+void GameState::Selections::select(iterator sel, BitBoard const & cells) {
+    auto & is_selected = sel->second.is_selected;
+    auto index = uint8_t(sel.i_);
+    auto joined = cells & ~is_selected, left = is_selected & ~cells;
+    is_selected = cells;
+    cutsKnown_[index >> 6] &= ~(1ULL << (index & 63));
+
+    forEachCell(joined, [&](int c) {
+        auto & o = owners_[c];
+        if (o != none && o != index) {
+            shared_.set(c & 15, c >> 4);
+            o = std::min(o, index);
+        } else {
+            o = index;
+        }
+    });
+    forEachCell(left, [&](int c) {
+        auto & o = owners_[c];
+        if (!shared_.isSet(c & 15, c >> 4)) {
+            o = none;
+            return;
+        }
+
+        // Selections only overlap when a drag into another one can't carve the cell out of it, so look for the rest.
+        size_t n = 0;
+        o = none;
+        for (auto const & s : *this)
+            if (s.second.is_selected.isSet(c & 15, c >> 4) && !n++)
+                o = uint8_t(s.first);
+        if (n < 2)
+            shared_ &= ~BitBoard::single(c & 15, c >> 4);
+    });
+}
+
+BitBoard GameState::Selections::cutCells(iterator sel) {
+    size_t i = sel.i_;
+    uint64_t bit = 1ULL << (i & 63);
+    if (!(cutsKnown_[i >> 6] & bit)) {
+        cuts_[i] = Connectivity::cutCells(sel->second.is_selected);
+        cutsKnown_[i >> 6] |= bit;
+    }
+    return cuts_[i];
+}
+
+GameState::GameState(size_t nColors, size_t width, size_t height, size_t * seed) : board_(nColors), width_(width), height_(height) {
     std::fill(begin(board_.colors), end(board_.colors), brac::BitBoard::empty());
 
+#ifdef __APPLE__
     seed_ = seed ? *seed : arc4random();
-    std::cerr << "SEED = " << std::hex << seed_ << std::dec << "\n";
+#else
+    seed_ = seed ? *seed : std::random_device{}();
+#endif
     std::mt19937 gen(seed_);
     std::uniform_int_distribution<> dist(0, board_.nColors() - 1);
 
@@ -31,19 +168,29 @@ GameState::GameState(size_t nColors, size_t width, size_t height, size_t * seed)
 }
 
 bool GameState::match(bool & incomplete) {
+    MEMORY_SCOPE("GameState::match");
+    METRIC_SPAN("GameState::match");
+    TRACE_SPAN("GameState::match");
+    if (!onInput.empty())
+        onInput(Input::match, {});
     std::vector<brac::BitBoard> bbs; bbs.reserve(sels_.size());
     std::transform(begin(sels_), end(sels_), back_inserter(bbs),
                    [](Selections::value_type const & s) { return s.second.is_selected; });
     auto finish = std::remove(begin(bbs), end(bbs), brac::BitBoard::empty());
     if (finish - begin(bbs) > 1 && bbs[0].count() > 2 && board_.selectionsMatch(begin(bbs), finish)) {
         if (!(incomplete = !board_.findOtherMatches(bbs).empty())) {
+            auto cleared = brac::BitBoard::empty();
             for (auto& s : sels_)
-                board_ &= ~s.second.is_selected;
+                cleared |= s.second.is_selected;
+            board_ &= ~cleared;
+            moves_.cleared(cleared);    // The next analysis searches around them, off this thread.
+            movesChanged();
+            beginChanges();
             for (auto const & sel : sels_)
-                indices_.insert(sel.first);
+                noteSelection(sel.first);
             sels_.clear();
             onBoardChanged();
-            onSelectionChanged();
+            endChanges();
             return true;
         }
     } else {
@@ -52,188 +199,382 @@ bool GameState::match(bool & incomplete) {
     return false;
 }
 
+void GameState::setMoves(MoveIndex const & moves) {
+    if (moves.ready() && moves.board() == board_) {
+        beginChanges();
+        for (auto const & sel : sels_)
+            noteSelection(sel.first);
+        moves_ = moves;
+        movesChanged();
+        reassess_ = true;
+        endChanges();
+    }
+}
+
 void GameState::touchesBegan(std::vector<Touch> const & touches) {
+    MEMORY_SCOPE("GameState::touchesBegan");
+    TRACE_SPAN("GameState::touchesBegan");
+    if (!onInput.empty())
+        onInput(Input::touchesBegan, touches);
+    beginChanges();
     for (auto const & t : touches) {
         auto is_touched = brac::BitBoard::single(t.p);
 
-        auto sel = std::find_if(begin(sels_), end(sels_), [&](Selections::value_type const & s) { return is_touched & s.second.is_selected; });
-        if (sel == end(sels_) && !indices_.empty()) {
-            auto i = std::min_element(begin(indices_), end(indices_));
-            sel = sels_.emplace(*i, Selection{}).first;
-            indices_.erase(i);
-            onSelectionChanged();
+        auto sel = sels_.owner(is_touched);
+        if (sel == end(sels_)) {
+            auto i = sels_.lowestFree();
+            if (i < Selections::capacity) {
+                noteSelection(i);
+                sel = sels_.emplace(i);
+            }
         }
         if (sel != end(sels_)) {
-            sel->second.key = t.key;
+            sels_.setKey(sel, t.key);
             sel->second.was_touched = is_touched;
             sel->second.added.clear();
         }
     }
+    endChanges();
 }
 
 void GameState::touchesMoved(std::vector<Touch> const & touches) {
+    MEMORY_SCOPE("GameState::touchesMoved");
+    TRACE_SPAN("GameState::touchesMoved");
+    if (!onInput.empty())
+        onInput(Input::touchesMoved, touches);
+    beginChanges();
+    auto is_occupied = board_.computeMask();    // Touches don't change the board.
     for (auto const & t : touches) {
-        auto i = findSelection(t);
+        auto i = sels_.withKey(t.key);
         if (i != end(sels_)) {
+            noteSelection(i->first);
             auto & sel = i->second;
             sel.has_moved = true;
             auto is_touched = brac::BitBoard::single(t.p);
 
             auto adjoins_touch = is_touched.nhood4();
-            auto is_occupied = board_.computeMask();
 
-            auto container = std::find_if(begin(sels_), end(sels_), [&](Selections::value_type const & s) { return !!(s.second.is_selected & is_touched); });
+            auto container = sels_.owner(is_touched);
             if (container == end(sels_) && !sel.has_deleted && (is_touched & is_occupied) && (!sel.is_selected || (sel.is_selected & adjoins_touch))) {
-                sel.is_selected |= is_touched;
+                sels_.select(i, sel.is_selected | is_touched);
 
                 sel.added.push_back(t.p);
-                onSelectionChanged();
             } else if ((sel.added.empty() || (sel.added.size() >= 2 && t.p == sel.added.end()[-2])) &&
                        is_touched != sel.was_touched &&
                        (is_touched & is_occupied & sel.is_selected) &&
                        (sel.was_touched & is_occupied & sel.is_selected))
             {
-                // Moved from one touched cell to another within the current selection. Erase?
-                brac::BitBoard erased = sel.is_selected & ~sel.was_touched;
-                if (floodFill(is_touched, erased) == erased)
-                    sel.is_selected = erased;
+                // Moved from one touched cell to another within the current selection. Erase, unless that would
+                // split it?
+                if (!(sels_.cutCells(i) & sel.was_touched))
+                    sels_.select(i, sel.is_selected & ~sel.was_touched);
 
                 if (!sel.added.empty())
                     sel.added.pop_back();
-                onSelectionChanged();
             } else if (container != end(sels_) && container != i && sel.is_selected.count() <= 1) {
+                noteSelection(container->first);
                 auto & csel = container->second;
 
-                // Moved from an unextended selection into another selection. Erase?
-                brac::BitBoard erased = csel.is_selected & ~is_touched;
-                if (floodFill(erased.ls1b(), erased) == erased)
-                    csel.is_selected = erased;
+                // Moved from an unextended selection into another selection. Erase, unless that would split it?
+                if (!(sels_.cutCells(container) & is_touched))
+                    sels_.select(container, csel.is_selected & ~is_touched);
 
-                sel.is_selected = is_touched;
+                sels_.select(i, is_touched);
                 sel.has_deleted = true;
 
-                if (!csel.is_selected) {
-                    indices_.insert(container->first);
+                if (!csel.is_selected)
                     sels_.erase(container);
-                }
-
-                onSelectionChanged();
             }
             sel.was_touched = is_touched;
         }
     }
+    endChanges();
 }
 
 void GameState::touchesEnded(std::vector<Touch> const & touches) {
+    MEMORY_SCOPE("GameState::touchesEnded");
+    TRACE_SPAN("GameState::touchesEnded");
+    if (!onInput.empty())
+        onInput(Input::touchesEnded, touches);
+    beginChanges();
     for (auto const & t : touches) {
         if (t.hasMoved) {
-            auto sel = findSelection(t);
+            auto sel = sels_.withKey(t.key);
             if (sel != end(sels_)) {
                 if (sel->second.is_selected.count() < 3) {
-                    indices_.insert(sel->first);
+                    noteSelection(sel->first);
                     sels_.erase(sel);
-                    onSelectionChanged();
                 } else {
-                    sel->second.key = nullptr;
+                    sels_.setKey(sel, nullptr);
                 }
             }
         } else {
-            tapped(t.p);
+            tap(t.p);
         }
     }
+    endChanges();
 }
 
 void GameState::touchesCancelled(std::vector<Touch> const & touches) {
+    MEMORY_SCOPE("GameState::touchesCancelled");
+    TRACE_SPAN("GameState::touchesCancelled");
+    if (!onInput.empty())
+        onInput(Input::touchesCancelled, touches);
     for (auto const & t : touches) {
-        auto sel = findSelection(t);
-        if (sel != end(sels_)) {
-            sel->second.key = nullptr;
-            onSelectionChanged();
-        }
+        auto sel = sels_.withKey(t.key);
+        if (sel != end(sels_))
+            sels_.setKey(sel, nullptr);
     }
 }
 
 void GameState::tapped(vec2 p) {
+    if (!onInput.empty())
+        onInput(Input::tapped, {Touch{nullptr, p, false}});
+    tap(p);
+}
+
+void GameState::tap(vec2 p) {
     auto is_touched = brac::BitBoard::single(p.x, p.y);
-    for (auto i = begin(sels_); i != end(sels_); ++i) {
-        if (i->second.is_selected & is_touched) {
-            indices_.insert(i->first);
-            i = sels_.erase(i);
-            onSelectionChanged();
-            return;
+    beginChanges();
+    auto i = sels_.owner(is_touched);
+    if (i != end(sels_)) {
+        noteSelection(i->first);
+        sels_.erase(i);
+    } else {
+        for (auto const & sel : sels_)
+            noteSelection(sel.first);
+        sels_.clear();
+    }
+    endChanges();
+}
+
+void GameState::noteSelection(size_t index) {
+    if (std::any_of(begin(before_), end(before_), [&](Before const & b) { return b.index == index; }))
+        return;
+    auto s = sels_.find(index);
+    if (s == end(sels_))
+        before_.push_back(Before{index, false, false, brac::BitBoard::empty()});
+    else
+        before_.push_back(Before{index, true, s->second.has_border(), s->second.is_selected});
+}
+
+void GameState::endChanges() {
+    if (--changing_)
+        return;
+
+    changes_.clear();
+    for (auto const & b : before_) {
+        auto s = sels_.find(b.index);
+        if (s == end(sels_)) {
+            if (b.existed)
+                changes_.push_back(SelectionChange{b.index, SelectionChange::removed, b.cells});
+        } else if (!b.existed) {
+            changes_.push_back(SelectionChange{b.index, SelectionChange::added, s->second.is_selected});
+        } else if (s->second.is_selected != b.cells || s->second.has_border() != b.border) {
+            changes_.push_back(SelectionChange{b.index, SelectionChange::modified, s->second.is_selected ^ b.cells});
+        } else if (reassess_) {
+            changes_.push_back(SelectionChange{b.index, SelectionChange::reassessed, brac::BitBoard::empty()});
         }
     }
-    for (auto const & sel : sels_) indices_.insert(sel.first);
-    sels_.clear();
-    onSelectionChanged();
+    before_.clear();
+    reassess_ = false;
+
+    // Work out where changed selections could go while the touch is fresh.
+    if (moves_.ready())
+        for (auto const & c : changes_)
+            if (c.kind != SelectionChange::removed) {
+                auto s = sels_.find(c.index);
+                if (s->second.is_selected)
+                    feasibility(s->second.is_selected);
+            }
+
+    // Handlers may start changes of their own, which need changes_ free.
+    if (!changes_.empty()) {
+        auto changes = std::move(changes_);
+        onSelectionChanged(changes);
+        changes_ = std::move(changes);
+    }
 }
 
-BitBoard::WithOrientation GameState::canonicalise(BitBoard const & bb) {
-    int nm = bb.marginN(), sm = bb.marginS(), em = bb.marginE(), wm = bb.marginW();
-    BitBoard::WithOrientation bbs[4] = {
-        BitBoard::ShiftRotate{{static_cast<int8_t>(-wm), static_cast<int8_t>(-sm)}, 0}(bb),
-        BitBoard::ShiftRotate{{static_cast<int8_t>(-wm), static_cast<int8_t>( nm)}, 1}(bb),
-        BitBoard::ShiftRotate{{static_cast<int8_t>( em), static_cast<int8_t>( nm)}, 2}(bb),
-        BitBoard::ShiftRotate{{static_cast<int8_t>( em), static_cast<int8_t>(-sm)}, 3}(bb),
-    };
+namespace {
+
+    // Canonical forms of recently seen shapes, keyed by the shape moved to the origin, so that every placement of a
+    // shape shares an entry. Direct-mapped: a new shape simply evicts whatever shared its slot.
+    class CanonicalCache {
+    public:
+        // Look up shape (at the origin), computing and storing its canonical orientation on a miss.
+        template <typename F>
+        std::pair<BitBoard, int> get(BitBoard const & shape, F compute) {
+            size_t h = hashWords({shape.a, shape.b, shape.c, shape.d});
+            auto & e = entries_[h % size];
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!e.used || e.shape != shape) {
+                auto c = compute(h);
+                e = Entry{shape, c.first, static_cast<int8_t>(c.second), true};
+            }
+            return {e.canonical, e.rotation};
+        }
+
+    private:
+        enum { size = 1024 };
 
-    // Deskew symmetric patterns.
-    std::mt19937 rng{std::hash<BitBoard>()(bb)};
-    std::shuffle(std::begin(bbs), std::end(bbs), rng);
+        struct Entry {
+            BitBoard shape, canonical;
+            int8_t rotation;
+            bool used;
+        };
+
+        std::mutex mutex_;
+        std::array<Entry, size> entries_{};
+    };
 
-    return *std::min_element(std::begin(bbs), std::end(bbs),
-                             [&](BitBoard::WithOrientation const & a, BitBoard::WithOrientation const & b) {
-                                 return a.bb < b.bb;
-                             });
 }
 
-GameState::ShapeMatcheses GameState::possibleMoves(Board const & board) {
-    auto pairs = board.findMatchingPairs();
+namespace {
+
+    // sr * bb, a cell at a time, which for a selection's few cells beats turning the whole board.
+    BitBoard applyToCells(BitBoard::ShiftRotate const & sr, BitBoard const & bb) {
+        auto image = BitBoard::empty();
+        forEachCell(bb, [&](int c) {
+            int x = c & 15, y = c >> 4;
+            if (Board::apply(sr, x, y))
+                image.set(x, y);
+        });
+        return image;
+    }
 
-#if 0
-    static mach_timebase_info_data_t tbi;
-    static std::once_flag once;
-    std::call_once(once, []{
-        mach_timebase_info(&tbi);
-    });
+}
 
-    auto at = []{ return mach_absolute_time() * tbi.numer / tbi.denom / 1000000; };
-    auto t1 = at();
-    constexpr int numtests = 1;
-    for (int i = 0; i < numtests; ++i)
-        auto pairs2 = findMatchingPairs(_board);
-    auto t2 = at();
-
-    if (numtests)
-        (std::cerr << pairs.size() << " matches found in " << (t2 - t1)/numtests << "ms\n");
-
-    std::vector<std::array<brac::BitBoard, 2>> biggest;
-    int biggest_count = 0;
-
-    std::map<int, int> histogram;
-    for (auto const & p : pairs) {
-        int count = p[0].count();
-        ++histogram[count];
-        if (biggest_count <= count) {
-            if (biggest_count < count) {
-                biggest_count = count;
-                biggest.clear();
+GameState::Feasibility const & GameState::feasibility(BitBoard const & partial) {
+    METRIC_SPAN("GameState::feasibility");
+    auto & slot = feasibilities_[hashWords({partial.a, partial.b, partial.c, partial.d}) % nFeasibilities];
+    if (slot.generation == generation_ && slot.feasibility.cells == partial)
+        return slot.feasibility;
+
+    completions_.clear();
+    if (moves_.ready() && partial) {
+        // Every move that can hold partial can hold any part of it, so start from the biggest recent part, if any.
+        Feasibility const * base = nullptr;
+        for (auto const & c : feasibilities_) {
+            auto const & f = c.feasibility;
+            if (c.generation == generation_ && f.known && f.cells && !(f.cells & ~partial) &&
+                (!base || f.cells.count() > base->cells.count()))
+                base = &f;
+        }
+        if (base) {
+            METRIC_COUNT("feasibility.filtered", 1);
+            for (auto const & c : base->completions)
+                if (!(partial & ~c.half))
+                    completions_.push_back(Completion{c.half, c.other, applyToCells(c.transform, partial), c.transform});
+        } else {
+            METRIC_COUNT("feasibility.searched", 1);
+            // Look through the moves that hold whichever cell of partial is in fewest.
+            int cell = -1;
+            forEachCell(partial, [&](int c) {
+                if (cell < 0 || starts_[c + 1] - starts_[c] < starts_[cell + 1] - starts_[cell])
+                    cell = c;
+            });
+            for (auto e = begin(byCell_) + starts_[cell]; e != begin(byCell_) + starts_[cell + 1]; ++e) {
+                auto const & m = *movesList_[*e >> 1];
+                int h = *e & 1;
+                auto const & p = m.first;
+                auto const & sr = m.second[h];
+                if (!(partial & ~p[h]) && sr.rotation >= 0)
+                    completions_.push_back(Completion{p[h], p[1 - h], applyToCells(sr, partial), sr});
             }
-            biggest.push_back(p);
         }
     }
+    METRIC_HISTOGRAM("feasibility.completions", completions_.size());
+
+    slot.generation = generation_;
+    slot.feasibility.cells = partial;
+    slot.feasibility.known = moves_.ready();
+    std::swap(slot.feasibility.completions, completions_);
+    return slot.feasibility;
+}
 
-    for (const auto& h : histogram)
-        (std::cerr << h.first << ": " << h.second << "\n");
+void GameState::movesChanged() {
+    ++generation_;
+    indexMoves();
+}
 
-    for (const auto& p : biggest) {
-        write(std::cerr, _board, {p.first, p.second}, "-RGBWK");
-    }
-#endif
+void GameState::indexMoves() {
+    MEMORY_SCOPE("GameState::indexMoves");
+    METRIC_SPAN("GameState::indexMoves");
+    movesList_.clear();
+    starts_.fill(0);
+    if (moves_.ready())
+        for (auto const & m : moves_.transforms()) {
+            movesList_.push_back(&m);
+            for (auto const & half : m.first)
+                forEachCell(half, [&](int c) { ++starts_[c + 1]; });
+        }
+    std::partial_sum(begin(starts_), end(starts_), begin(starts_));
+
+    byCell_.resize(starts_[256]);
+    auto next = starts_;
+    for (uint32_t i = 0; i < movesList_.size(); ++i)
+        for (uint32_t h = 0; h < 2; ++h)
+            forEachCell(movesList_[i]->first[h], [&](int c) { byCell_[next[c]++] = 2 * i + h; });
+}
+
+BitBoard::WithOrientation GameState::canonicalise(BitBoard const & bb) {
+    static CanonicalCache cache;
+
+    auto shape = bb.shiftWS(bb.marginW(), bb.marginS());
+    auto canonical = cache.get(shape, [&](size_t h) {
+        // Take the least orientation. Symmetric shapes tie; deskew them by starting the scan at an orientation picked
+        // by the shape's hash, so that different shapes favor different orientations, but each always gets the same.
+        int first = h & 3, best = first;
+        auto bestBB = Board::toOrigin(shape, best) * shape;
+        for (int i = 1; i < 4; ++i) {
+            int r = (first + i) & 3;
+            auto rbb = Board::toOrigin(shape, r) * shape;
+            if (rbb < bestBB) {
+                best = r;
+                bestBB = rbb;
+            }
+        }
+        return std::make_pair(bestBB, best);
+    });
 
-    ShapeMatcheses matcheses;
+    return BitBoard::WithOrientation{canonical.first, Board::toOrigin(bb, canonical.second)};
+}
+
+GameState::ShapeMatcheses GameState::possibleMoves(Board const & board, size_t nThreads, Board::Engine engine, OnGroup const & onGroup) {
+    MEMORY_SCOPE("GameState::possibleMoves");
+    AnalysisContext ctx;
+    possibleMoves(ctx, board, nThreads, engine, onGroup);
+    return std::move(ctx.matcheses);
+}
+
+GameState::ShapeMatcheses GameState::possibleMoves(Board::Pairs const & pairs, OnGroup const & onGroup) {
+    MEMORY_SCOPE("GameState::possibleMoves");
+    AnalysisContext ctx;
+    possibleMoves(ctx, pairs, onGroup);
+    return std::move(ctx.matcheses);
+}
+
+GameState::ShapeMatcheses const & GameState::possibleMoves(AnalysisContext & ctx, Board const & board, size_t nThreads,
+                                                           Board::Engine engine, OnGroup const & onGroup) {
+    return possibleMoves(ctx, board.findMatchingPairs(ctx, nullptr, nThreads, engine), onGroup);
+}
 
-    std::vector<Match> matches;
+GameState::ShapeMatcheses const & GameState::possibleMoves(AnalysisContext & ctx, Board::Pairs const & pairs, OnGroup const & onGroup) {
+    MEMORY_SCOPE("GameState::possibleMoves");
+    METRIC_SPAN("GameState::possibleMoves");
+    TRACE_SPAN("GameState::possibleMoves");
+
+    ctx.arena.reset();
+    ctx.recycleMatcheses();
+    auto & matcheses = ctx.matcheses;
+
+    // Groups are ordered by score first, and every match of a shape has the same score, so each score's groups can be
+    // formed, sorted and handed out before the next score's are looked at. A counting sort lays the pairs out by score,
+    // biggest first.
+    typedef std::array<brac::BitBoard, 2> Pair;
+    size_t const nScores = 16 * 16 / 2 + 1;
+    ArenaVector<size_t> starts(nScores + 1, 0, ArenaAllocator<size_t>(ctx.arena));
     for (const auto& p : pairs) {
         int score = p[0].count();
 
@@ -247,31 +588,47 @@ GameState::ShapeMatcheses GameState::possibleMoves(Board const & board) {
         }
 #endif
 
-        matches.emplace_back(p[0], p[1], score);
+        ++starts[nScores - score];
     }
+    std::partial_sum(begin(starts), end(starts), begin(starts));
+    ArenaVector<Pair const *> byScore(pairs.size(), nullptr, ArenaAllocator<Pair const *>(ctx.arena));
+    for (const auto& p : pairs)
+        byScore[--starts[nScores - p[0].count()]] = &p;
+
+    // Within a score, sort the pairs by the canonical form of their shape, so that each shape's matches are a run.
+    typedef std::pair<brac::BitBoard, Pair const *> Shaped;
+    ArenaVector<Shaped> shaped{ArenaAllocator<Shaped>(ctx.arena)};
+    shaped.reserve(pairs.size());
+
+    for (size_t k = 0; k < nScores; ++k) {
+        int score = static_cast<int>(nScores - k);
+        shaped.clear();
+        for (auto p = begin(byScore) + starts[k]; p != begin(byScore) + starts[k + 1]; ++p)
+            shaped.emplace_back(canonicalise((**p)[0]).bb, *p);
+        if (shaped.empty())
+            continue;
+        std::sort(begin(shaped), end(shaped), [](Shaped const & a, Shaped const & b) { return a.first < b.first; });
+
+        auto first = matcheses.size();
+        for (auto run = begin(shaped); run != end(shaped);) {
+            auto next = std::find_if(run, end(shaped), [&](Shaped const & s) { return s.first != run->first; });
+            auto group = ctx.group(next - run);
+            group->shape = run->first;
+            for (; run != next; ++run)
+                group->matches.emplace_back((*run->second)[0], (*run->second)[1], score);
+            METRIC_HISTOGRAM("grouping.groupSize", group->matches.size());
+            matcheses.push_back(std::move(group));
+        }
 
-    typedef std::unordered_map<brac::BitBoard, std::vector<Match>> ShapeMap;
-    ShapeMap shape_histogram;
-    for (const auto& m : matches) {
-        shape_histogram[canonicalise(m.shape1).bb].push_back(m);
-    }
-    matcheses.clear(); matcheses.reserve(shape_histogram.size());
-    std::transform(begin(shape_histogram), end(shape_histogram), back_inserter(matcheses),
-                   [](ShapeMap::value_type const & sm) { return std::make_shared<ShapeMatches>(ShapeMatches{sm.first, sm.second}); });
+        // With equal scores, comparing score lists lexicographically puts shorter lists first; then sort on bit-value.
+        std::sort(begin(matcheses) + first, end(matcheses), [](const std::shared_ptr<ShapeMatches>& a, const std::shared_ptr<ShapeMatches>& b) {
+            return a->matches.size() < b->matches.size() || (a->matches.size() == b->matches.size() && a->shape > b->shape);
+        });
 
-    for (auto& sm : matcheses) {
-        // Sort matches by score.
-        std::sort(begin(sm->matches), end(sm->matches), [](Match const & a, Match const & b) { return a.score > b.score; });
+        if (onGroup)
+            for (auto i = begin(matcheses) + first; i != end(matcheses); ++i)
+                onGroup(*i);
     }
 
-    // Sort by lexicograpically comparing score lists, secondarily on bit-value.
-    std::sort(begin(matcheses), end(matcheses), [](const std::shared_ptr<ShapeMatches>& a, const std::shared_ptr<ShapeMatches>& b) {
-        auto comp = [](Match const & a, Match const & b) { return a.score > b.score; };
-
-        return (std::lexicographical_compare(begin(a->matches), end(a->matches), begin(b->matches), end(b->matches), comp) ||
-                (!std::lexicographical_compare(begin(b->matches), end(b->matches), begin(a->matches), end(a->matches), comp) &&
-                 a->shape > b->shape));
-    });
-
     return matcheses;
 }
@@ -4,24 +4,28 @@
 #define INCLUDED__GameState_h
 
 #import <bricabrac/Math/BitBoard.h>
+#import "AnalysisContext.h"
 #import "Board.h"
+#import "MoveIndex.h"
 #import "ShapeMatches.h"
-#import "Signal.h"
 
 #include <bricabrac/Math/vec2.h>
 
 #include <boost/signals2.hpp>
 
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
 #include <vector>
-#include <unordered_map>
-#include <unordered_set>
 
 class GameState {
 public:
     class Selection {
     public:
-        void const * key;
-        brac::BitBoard is_selected{0, 0, 0, 0};
+        void const * key;                               // Set through Selections::setKey().
+        brac::BitBoard is_selected{0, 0, 0, 0};         // Set through Selections::select().
         bool has_moved = false;
         brac::BitBoard was_touched{0, 0, 0, 0};
         std::vector<brac::vec2> added;
@@ -37,13 +41,136 @@ public:
     };
     
     typedef std::vector<std::shared_ptr<ShapeMatches>>  ShapeMatcheses;
-    typedef std::unordered_map<size_t, Selection>       Selections;
-    
+
     enum { minimumSelection = 3 };
 
-    boost::signals2::signal<void()> onSelectionChanged;
+    // The selections in play, read like a map from index to Selection and visited in index order. Indices are slots in
+    // a fixed array, handed out lowest first from a bitmask of the free ones. Each cell and each touch key is indexed to
+    // the selection that holds it, so finding the selection under a finger or steered by a touch takes the same time
+    // however many are in play.
+    class Selections {
+    public:
+        enum { capacity = 256 / minimumSelection + 1 };     // More than a board can hold at once.
+
+        typedef std::pair<size_t, Selection> value_type;    // Don't change first.
+
+        template <typename S, typename V>
+        class Iterator {
+        public:
+            typedef std::forward_iterator_tag   iterator_category;
+            typedef V                           value_type;
+            typedef std::ptrdiff_t              difference_type;
+            typedef V *                         pointer;
+            typedef V &                         reference;
+
+            Iterator() = default;
+            operator Iterator<Selections const, V const>() const { return {sels_, i_}; }
+
+            V & operator*() const { return sels_->slots_[i_]; }
+            V * operator->() const { return &sels_->slots_[i_]; }
+            Iterator & operator++() { i_ = sels_->next(i_ + 1); return *this; }
+            Iterator operator++(int) { auto i = *this; ++*this; return i; }
+
+            bool operator==(Iterator const & i) const { return i_ == i.i_; }
+            bool operator!=(Iterator const & i) const { return i_ != i.i_; }
+
+        private:
+            friend class Selections;
+            template <typename, typename> friend class Iterator;
+
+            S * sels_ = nullptr;
+            size_t i_ = capacity;
+
+            Iterator(S * sels, size_t i) : sels_(sels), i_(i) { }
+        };
+        typedef Iterator<Selections, value_type> iterator;
+        typedef Iterator<Selections const, value_type const> const_iterator;
+
+        Selections();
+
+        bool empty() const { return !(used_[0] | used_[1]); }
+        size_t size() const { return __builtin_popcountll(used_[0]) + __builtin_popcountll(used_[1]); }
+
+        iterator       begin()       { return {this, next(0)}; }
+        const_iterator begin() const { return {this, next(0)}; }
+        iterator       end  ()       { return {this, capacity}; }
+        const_iterator end  () const { return {this, capacity}; }
+
+        friend iterator       begin(Selections       & s) { return s.begin(); }
+        friend const_iterator begin(Selections const & s) { return s.begin(); }
+        friend iterator       end  (Selections       & s) { return s.end  (); }
+        friend const_iterator end  (Selections const & s) { return s.end  (); }
+
+        iterator       find(size_t index)       { return {this, isUsed(index) ? index : size_t(capacity)}; }
+        const_iterator find(size_t index) const { return {this, isUsed(index) ? index : size_t(capacity)}; }
+
+        // Throws std::out_of_range if there's no selection at index.
+        Selection const & at(size_t index) const;
+
+        // The lowest index not in use, or capacity if all are.
+        size_t lowestFree() const;
+
+        // Start an empty selection at index, which must be free.
+        iterator emplace(size_t index);
+
+        void erase(iterator sel);
+        void clear();
+
+        // The selection that holds cell (a single cell), the lowest-indexed if it's in more than one.
+        iterator owner(brac::BitBoard const & cell);
+
+        // The selection that the touch with this key is steering. A touch steers one selection at a time.
+        iterator withKey(void const * key);
+
+        void setKey(iterator sel, void const * key);
+        void select(iterator sel, brac::BitBoard const & cells);
+
+        // The cells of sel that it can't lose without falling apart (see Connectivity::cutCells()). Worked out when
+        // first asked for after its cells change, so a finger roaming over a selection asks once per change.
+        brac::BitBoard cutCells(iterator sel);
+
+    private:
+        enum : uint8_t { none = 0xff };
+
+        std::array<value_type, capacity>                        slots_;
+        uint64_t                                                used_[2] = {0, 0};
+        std::array<uint8_t, 256>                                owners_;    // By cell, x + 16y; none if unselected.
+        brac::BitBoard                                          shared_{0, 0, 0, 0};    // Cells in more than one.
+        std::array<std::pair<void const *, uint8_t>, capacity>  keys_;      // The first nKeys_ are in use.
+        size_t                                                  nKeys_ = 0;
+        std::array<brac::BitBoard, capacity>                    cuts_;
+        uint64_t                                                cutsKnown_[2] = {0, 0};
+
+        bool isUsed(size_t index) const { return index < capacity && used_[index >> 6] >> (index & 63) & 1; }
+        size_t next(size_t index) const;
+    };
+
+    // How one selection differs after an onSelectionChanged event from before it. A selection is reassessed when it
+    // is as it was but the moves that could hold it have changed.
+    struct SelectionChange {
+        enum Kind { added, removed, modified, reassessed };
+
+        size_t index;           // Its key in sels().
+        Kind kind;
+        brac::BitBoard cells;   // The cells that joined or left it: all of them if it was added or removed, and none
+                                // if only has_border() or the moves changed.
+    };
+    typedef std::vector<SelectionChange> SelectionChanges;
+
+    // Fired once per call that changes selections (a batch of touches, a tap, a match), with an entry for each selection
+    // that ended up different, and by setMoves() with every selection reassessed. Selections that changed and changed back aren't listed, and a call that leaves them all
+    // as they were fires nothing.
+    boost::signals2::signal<void(SelectionChanges const &)> onSelectionChanged;
     boost::signals2::signal<void()> onBoardChanged;
 
+    // The calls through which a player drives the game.
+    enum class Input : uint8_t { touchesBegan, touchesMoved, touchesEnded, touchesCancelled, tapped, match, nInputs };
+
+    // Fired as each input arrives, before it is handled, so that it can be recorded (see TouchTrace). A tap is passed as
+    // one touch with a null key, and a match with no touches. Taps that touchesEnded() makes aren't fired again. Inputs
+    // check for a slot before firing, so they pay nothing for this while no recorder is attached.
+    boost::signals2::signal<void(Input, std::vector<Touch> const &)> onInput;
+
     GameState(size_t nColors, size_t width, size_t height, size_t * seed = nullptr);
 
     bool match(bool & incomplete);
@@ -53,6 +180,40 @@ public:
     size_t                  height() const { return height_   ; }
     Board           const & board () const { return board_    ; }
     Selections      const & sels  () const { return sels_     ; }
+    MoveIndex       const & moves () const { return moves_    ; }
+
+    // Adopt an index computed elsewhere (e.g., on a background thread), provided it is for the current board. match()
+    // only notes the cells it clears on the index, which then isn't ready until an updated one is adopted. Selections
+    // drawn in the meantime are reassessed against the new moves.
+    void setMoves(MoveIndex const & moves);
+
+    // One way a selection's cells could still become half of a match: a move in moves() with a half that holds them.
+    // transform carries half onto other dot for dot, so counterpart, the cells' image, is where their match would be.
+    struct Completion {
+        brac::BitBoard half, other, counterpart;
+        brac::BitBoard::ShiftRotate transform;
+    };
+
+    struct Feasibility {
+        brac::BitBoard cells{0, 0, 0, 0};
+        bool known = false;                     // Whether there was a move index to ask.
+        std::vector<Completion> completions;    // None if the cells aren't part of any move.
+    };
+
+    // How partial, a selection's cells, could still grow into a match, for feedback while the player drags. Answers
+    // for recent shapes are kept, and a shape that grew from one of them filters its completions rather than
+    // searching every move, so it can be asked at touch rate. Selections that change are asked about before
+    // onSelectionChanged fires, so handlers find their answers ready. The result is only good until the next call.
+    Feasibility const & feasibility(brac::BitBoard const & partial);
+
+    // Whether a selection of these cells can't be half of a match as things stand: too small, or held by no move.
+    // While the moves aren't known, only size counts.
+    bool hopeless(brac::BitBoard const & cells) {
+        if (cells.count() < minimumSelection)
+            return true;
+        auto const & f = feasibility(cells);
+        return f.known && f.completions.empty();
+    }
 
     void touchesBegan    (std::vector<Touch> const & touches);
     void touchesMoved    (std::vector<Touch> const & touches);
@@ -60,22 +221,71 @@ public:
     void touchesCancelled(std::vector<Touch> const & touches);
     void tapped(brac::vec2 p);
 
+    // The least of bb's four orientations, moved to the origin, with the transform that takes bb there. Symmetric
+    // shapes break ties by a fixed rule per shape. Results are cached by shape, so repeated shapes are cheap.
     static brac::BitBoard::WithOrientation canonicalise(brac::BitBoard const & bb);
 
-    static ShapeMatcheses possibleMoves(Board const & board);
+    // Receives each group of matches as soon as it is final, in the same order as the list that possibleMoves()
+    // returns: biggest shapes first.
+    typedef std::function<void(std::shared_ptr<ShapeMatches> const &)> OnGroup;
+
+    static ShapeMatcheses possibleMoves(Board const & board, size_t nThreads = 1, Board::Engine engine = Board::Engine::adaptive,
+                                        OnGroup const & onGroup = nullptr);
+    static ShapeMatcheses possibleMoves(Board::Pairs const & pairs, OnGroup const & onGroup = nullptr);
+
+    // The same, into ctx.matcheses. Once ctx has analysed a board like this one, analysing again allocates nothing,
+    // provided the groups of ctx's last result have been let go of.
+    static ShapeMatcheses const & possibleMoves(AnalysisContext & ctx, Board const & board, size_t nThreads = 1,
+                                                Board::Engine engine = Board::Engine::adaptive, OnGroup const & onGroup = nullptr);
+    static ShapeMatcheses const & possibleMoves(AnalysisContext & ctx, Board::Pairs const & pairs, OnGroup const & onGroup = nullptr);
 
 private:
     size_t                      seed_;
     size_t                      width_, height_;
     Board                       board_;
     Selections                  sels_;
-    std::unordered_set<size_t>  indices_;
+    MoveIndex                   moves_;
+
+    // Selection changes being coalesced: how each selection touched so far looked before the outermost call began.
+    struct Before {
+        size_t index;
+        bool existed, border;
+        brac::BitBoard cells;
+    };
+    size_t                      changing_ = 0;
+    bool                        reassess_ = false;  // Whether unchanged selections are listed too, as reassessed.
+    std::vector<Before>         before_;
+    SelectionChanges            changes_;
+
+    // Recent feasibility() answers, direct-mapped by shape, good for the moves of one generation, which ends when the
+    // moves or board change.
+    struct CachedFeasibility {
+        Feasibility feasibility;
+        size_t generation = 0;
+    };
+    enum { nFeasibilities = 64 };
+    std::array<CachedFeasibility, nFeasibilities>           feasibilities_;
+    std::vector<Completion>                                 completions_;
+    size_t                                                  generation_ = 1;
+
+    // The halves of moves() by cell, so that a search visits only the moves through one of its cells: entries
+    // byCell_[starts_[i], starts_[i + 1]) are 2p + h for half h of move movesList_[p], for each that holds cell i.
+    // Rebuilt whenever the moves change, from the transforms the index found off this thread, so no touch pays for it.
+    std::vector<MoveIndex::Transforms::value_type const *>  movesList_;
+    std::vector<uint32_t>                                   byCell_;
+    std::array<uint32_t, 257>                               starts_;
+
+    void movesChanged();
+    void indexMoves();
 
     void handleTouch(brac::BitBoard is_touched, Selection& sel);
+    void tap(brac::vec2 p);
 
-    Selections::iterator findSelection(Touch const & touch) {
-        return std::find_if(begin(sels_), end(sels_), [&](Selections::value_type const & s){ return s.second.key == touch.key; });
-    }
+    // Bracket a call that may change selections, and note each selection before changing it. The outermost
+    // endChanges() fires onSelectionChanged with the differences.
+    void beginChanges() { ++changing_; }
+    void noteSelection(size_t index);
+    void endChanges();
 };
 
 #endif // INCLUDED__GameState_h
@@ -0,0 +1,63 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__Instrumentation_h
+#define INCLUDED__Instrumentation_h
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+// What MemoryProfile, Metrics and Trace have in common: a fixed table of named sites, and a dump to a path named in
+// the environment when the process exits.
+namespace Instrumentation {
+
+    // Sites are named by string literals (or other strings that outlive the process). A table holds at most maxSites
+    // of them; the rest share the last.
+    enum { maxSites = 64 };
+
+    // The index of the site called name in sites, registering it if it's new. The first reserved sites are kept by the
+    // caller and never match. This takes a lock, so call it once per site and keep the index; readers only look below
+    // nSites and need none.
+    template <typename Site>
+    int site(Site (&sites)[maxSites], std::atomic<int> & nSites, int reserved, char const * name) {
+        static std::mutex mutex;
+        std::lock_guard<std::mutex> lock(mutex);
+        int n = nSites;
+        for (int i = reserved; i < n; ++i)
+            if (!std::strcmp(sites[i].name, name))
+                return i;
+        if (n == maxSites)
+            return maxSites - 1;
+        sites[n].name = name;
+        nSites = n + 1;
+        return n;
+    }
+
+    // If the environment variable is set when the process starts, calls start (if any) then, and dump with its value
+    // on exit. Declare one as a static.
+    class DumpAtExit {
+    public:
+        DumpAtExit(char const * variable, bool (*dump)(char const * path), void (*start)() = nullptr)
+        : path_(std::getenv(variable)), dump_(dump)
+        {
+            if (path_ && start)
+                start();
+        }
+
+        ~DumpAtExit() {
+            if (path_)
+                dump_(path_);
+        }
+
+        DumpAtExit(DumpAtExit const &) = delete;
+        DumpAtExit & operator=(DumpAtExit const &) = delete;
+
+    private:
+        char const * path_;
+        bool (*dump_)(char const * path);
+    };
+
+}
+
+#endif // INCLUDED__Instrumentation_h
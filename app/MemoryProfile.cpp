@@ -0,0 +1,178 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#include "MemoryProfile.h"
+
+#include "Instrumentation.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+    using Instrumentation::maxSites;
+
+    // Counters for one scope, or for everything. Plain atomics, constant-initialized, so allocations made while other
+    // statics are still being constructed find them ready.
+    struct Counters {
+        std::atomic<char const *> name;
+        std::atomic<size_t> allocations, bytes, live, peak;
+
+        void allocated(size_t n) {
+            allocations.fetch_add(1, std::memory_order_relaxed);
+            bytes.fetch_add(n, std::memory_order_relaxed);
+            size_t now = live.fetch_add(n, std::memory_order_relaxed) + n;
+            for (size_t p = peak.load(std::memory_order_relaxed); p < now && !peak.compare_exchange_weak(p, now);) { }
+        }
+
+        void freed(size_t n) {
+            live.fetch_sub(n, std::memory_order_relaxed);
+        }
+
+        void reset() {
+            allocations = 0;
+            bytes = 0;
+            peak = live.load();
+        }
+
+        MemoryProfile::Figures figures() const {
+            return MemoryProfile::Figures{name, allocations, bytes, live, peak};
+        }
+    };
+
+    Counters everything;
+    Counters sites[maxSites];
+    std::atomic<int> nSites{1};     // Site 0 is "(unscoped)".
+
+    thread_local int currentSite = 0;
+
+#ifdef MEMORY_PROFILE
+
+    // Each block carries its size and scope ahead of it, so that a free can be charged without a lookup. Sixteen
+    // bytes keep the block as aligned as malloc's.
+    struct alignas(16) Header {
+        size_t size;
+        int site;
+    };
+
+    void * allocate(size_t n) noexcept {
+        auto h = static_cast<Header *>(std::malloc(sizeof(Header) + n));
+        if (!h)
+            return nullptr;
+        h->size = n;
+        h->site = currentSite;
+        everything.allocated(n);
+        sites[h->site].allocated(n);
+        return h + 1;
+    }
+
+    void release(void * p) noexcept {
+        if (!p)
+            return;
+        auto h = static_cast<Header *>(p) - 1;
+        everything.freed(h->size);
+        sites[h->site].freed(h->size);
+        std::free(h);
+    }
+
+    bool const built = true;
+    Instrumentation::DumpAtExit dumpAtExit{"MEMORY_PROFILE_DUMP", MemoryProfile::dump};
+
+#else
+
+    bool const built = false;
+
+#endif
+
+}
+
+#ifdef MEMORY_PROFILE
+
+void * operator new(size_t n) {
+    if (void * p = allocate(n))
+        return p;
+    throw std::bad_alloc();
+}
+
+void * operator new[](size_t n) {
+    if (void * p = allocate(n))
+        return p;
+    throw std::bad_alloc();
+}
+
+void * operator new  (size_t n, std::nothrow_t const &) noexcept { return allocate(n); }
+void * operator new[](size_t n, std::nothrow_t const &) noexcept { return allocate(n); }
+
+void operator delete  (void * p) noexcept { release(p); }
+void operator delete[](void * p) noexcept { release(p); }
+void operator delete  (void * p, std::nothrow_t const &) noexcept { release(p); }
+void operator delete[](void * p, std::nothrow_t const &) noexcept { release(p); }
+void operator delete  (void * p, size_t) noexcept { release(p); }
+void operator delete[](void * p, size_t) noexcept { release(p); }
+
+#endif
+
+namespace MemoryProfile {
+
+    bool enabled() {
+        return built;
+    }
+
+    Figures total() {
+        auto f = everything.figures();
+        f.name = "total";
+        return f;
+    }
+
+    std::vector<Figures> scopes() {
+        std::vector<Figures> result;
+        for (int i = 0; i < nSites; ++i)
+            result.push_back(sites[i].figures());
+        result[0].name = "(unscoped)";
+        return result;
+    }
+
+    void reset() {
+        everything.reset();
+        for (auto & s : sites)
+            s.reset();
+    }
+
+    bool dump(char const * path) {
+        auto const all = scopes();
+        std::FILE * f = std::fopen(path, "w");
+        if (!f)
+            return false;
+        auto write = [&](Figures const & s) {
+            std::fprintf(f, "{\"name\": \"%s\", \"allocations\": %zu, \"bytes\": %zu, \"live\": %zu, \"peak\": %zu}",
+                         s.name, s.allocations, s.bytes, s.live, s.peak);
+        };
+        std::fprintf(f, "{\n  \"total\": ");
+        write(total());
+        std::fprintf(f, ",\n  \"scopes\": [");
+        for (auto const & s : all) {
+            std::fprintf(f, &s == &all[0] ? "\n    " : ",\n    ");
+            write(s);
+        }
+        std::fprintf(f, "\n  ]\n}\n");
+        return std::fclose(f) == 0;
+    }
+
+    int current() {
+        return currentSite;
+    }
+
+    int site(char const * name) {
+        return Instrumentation::site(sites, nSites, 1, name);
+    }
+
+    Scope::Scope(int site) : outer_(currentSite) {
+        currentSite = site;
+    }
+
+    Scope::~Scope() {
+        currentSite = outer_;
+    }
+
+}
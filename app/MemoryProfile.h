@@ -0,0 +1,72 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__MemoryProfile_h
+#define INCLUDED__MemoryProfile_h
+
+#include <cstddef>
+#include <vector>
+
+// Opt-in accounting of heap use. Build with MEMORY_PROFILE defined and every operator new and delete is counted:
+// allocations, bytes, and live bytes with their peak, in total and per scope. MEMORY_SCOPE("name") opens a scope that
+// lasts to the end of the enclosing block. An allocation is charged to the innermost scope open on its thread when it
+// is made, and its free is charged to the same scope, wherever that happens. Without MEMORY_PROFILE, MEMORY_SCOPE
+// compiles to nothing and the figures stay at zero.
+//
+// Setting MEMORY_PROFILE_DUMP to a path in the environment writes the figures there (see dump()) when the process
+// exits, so a device build can report the same figures as the benchmark without any UI for it.
+namespace MemoryProfile {
+
+    struct Figures {
+        char const * name;
+        size_t allocations, bytes;  // Since the last reset().
+        size_t live, peak;          // Bytes allocated and not yet freed, and the most there have been since reset().
+    };
+
+    // True iff built with MEMORY_PROFILE.
+    bool enabled();
+
+    // Every allocation, scoped or not.
+    Figures total();
+
+    // Each scope, in the order they were first opened. Allocations outside any scope are under "(unscoped)".
+    std::vector<Figures> scopes();
+
+    // Start counting afresh. Live bytes carry over, since their frees are still to come; peaks restart from them.
+    void reset();
+
+    // Write total() and scopes() to path as JSON. Returns false if the file can't be written.
+    bool dump(char const * path);
+
+    // The scope that allocations on this thread are charged to, by its index in scopes().
+    int current();
+
+    // The index of the scope called name, registered as an Instrumentation site.
+    int site(char const * name);
+
+    // Charge this thread's allocations to a scope until destroyed. MEMORY_SCOPE opens one; threads that work on behalf
+    // of another can open one with the other thread's current() to inherit its scope.
+    class Scope {
+    public:
+        explicit Scope(int site);
+        ~Scope();
+
+        Scope(Scope const &) = delete;
+        Scope & operator=(Scope const &) = delete;
+
+    private:
+        int outer_;
+    };
+
+}
+
+#ifdef MEMORY_PROFILE
+#define MEMORY_PROFILE_CAT2(a, b) a##b
+#define MEMORY_PROFILE_CAT(a, b) MEMORY_PROFILE_CAT2(a, b)
+#define MEMORY_SCOPE(name)                                                                          \
+    static int const MEMORY_PROFILE_CAT(memorySite_, __LINE__) = MemoryProfile::site(name);         \
+    MemoryProfile::Scope MEMORY_PROFILE_CAT(memoryScope_, __LINE__)(MEMORY_PROFILE_CAT(memorySite_, __LINE__))
+#else
+#define MEMORY_SCOPE(name) ((void)0)
+#endif
+
+#endif // INCLUDED__MemoryProfile_h
@@ -0,0 +1,125 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#include "Metrics.h"
+
+#include "Instrumentation.h"
+
+#include <atomic>
+#include <cstdio>
+
+namespace {
+
+    using Instrumentation::maxSites;
+
+    struct CounterSite {
+        std::atomic<char const *> name;
+        std::atomic<uint64_t> value;
+    };
+
+    struct HistogramSite {
+        std::atomic<char const *> name;
+        std::atomic<uint64_t> count, sum, max;
+        std::atomic<uint64_t> buckets[Metrics::Histogram::nBuckets];
+    };
+
+    CounterSite counterSites[maxSites];
+    HistogramSite histogramSites[maxSites];
+    std::atomic<int> nCounters{0}, nHistograms{0};
+
+    int bucketOf(uint64_t value) {
+        int b = 0;
+        for (; value; value >>= 1)
+            ++b;
+        return b;
+    }
+
+#ifdef METRICS
+    bool const built = true;
+    Instrumentation::DumpAtExit dumpAtExit{"METRICS_DUMP", Metrics::dump};
+#else
+    bool const built = false;
+#endif
+
+}
+
+namespace Metrics {
+
+    bool enabled() {
+        return built;
+    }
+
+    std::vector<Counter> counters() {
+        std::vector<Counter> result;
+        for (int i = 0; i < nCounters; ++i)
+            result.push_back(Counter{counterSites[i].name, counterSites[i].value});
+        return result;
+    }
+
+    std::vector<Histogram> histograms() {
+        std::vector<Histogram> result;
+        for (int i = 0; i < nHistograms; ++i) {
+            auto const & s = histogramSites[i];
+            Histogram h{s.name, s.count, s.sum, s.max, {}};
+            for (int b = 0; b < Histogram::nBuckets; ++b)
+                h.buckets[b] = s.buckets[b];
+            result.push_back(h);
+        }
+        return result;
+    }
+
+    void reset() {
+        for (auto & s : counterSites)
+            s.value = 0;
+        for (auto & s : histogramSites) {
+            s.count = 0;
+            s.sum = 0;
+            s.max = 0;
+            for (auto & b : s.buckets)
+                b = 0;
+        }
+    }
+
+    bool dump(char const * path) {
+        auto const cs = counters();
+        auto const hs = histograms();
+        std::FILE * f = std::fopen(path, "w");
+        if (!f)
+            return false;
+        std::fprintf(f, "{\n  \"counters\": {");
+        for (auto const & c : cs)
+            std::fprintf(f, "%s\n    \"%s\": %llu", &c == &cs[0] ? "" : ",", c.name, (unsigned long long)c.value);
+        std::fprintf(f, "\n  },\n  \"histograms\": {");
+        for (auto const & h : hs) {
+            std::fprintf(f, "%s\n    \"%s\": {\"count\": %llu, \"sum\": %llu, \"max\": %llu, \"buckets\": [",
+                         &h == &hs[0] ? "" : ",", h.name,
+                         (unsigned long long)h.count, (unsigned long long)h.sum, (unsigned long long)h.max);
+            int last = bucketOf(h.max);
+            for (int b = 0; b <= last; ++b)
+                std::fprintf(f, "%s%llu", b ? ", " : "", (unsigned long long)h.buckets[b]);
+            std::fprintf(f, "]}");
+        }
+        std::fprintf(f, "\n  }\n}\n");
+        return std::fclose(f) == 0;
+    }
+
+    int counter(char const * name) {
+        return Instrumentation::site(counterSites, nCounters, 0, name);
+    }
+
+    int histogram(char const * name) {
+        return Instrumentation::site(histogramSites, nHistograms, 0, name);
+    }
+
+    void add(int counter, uint64_t n) {
+        counterSites[counter].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void record(int histogram, uint64_t value) {
+        auto & s = histogramSites[histogram];
+        s.count.fetch_add(1, std::memory_order_relaxed);
+        s.sum.fetch_add(value, std::memory_order_relaxed);
+        s.buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        for (uint64_t m = s.max.load(std::memory_order_relaxed); m < value && !s.max.compare_exchange_weak(m, value);) { }
+    }
+
+}
@@ -0,0 +1,99 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__Metrics_h
+#define INCLUDED__Metrics_h
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Opt-in counters, histograms and timers for the game core. Build with METRICS defined to record them; otherwise the
+// METRIC_* macros compile to nothing and don't evaluate their arguments, so they cost nothing in the hot path.
+//
+//   METRIC_COUNT("finder.analyses", n);          // Add n to a counter.
+//   METRIC_HISTOGRAM("finder.matchSize", size);  // Record one value.
+//   METRIC_SPAN("GameState::match");             // Time the rest of the block, in ns, into a histogram.
+//
+// Recording is a few relaxed atomic adds, so the macros are safe on worker threads. Figures are read back with
+// counters() and histograms(), or written out with dump(). Setting METRICS_DUMP to a path in the environment dumps them
+// there when the process exits.
+namespace Metrics {
+
+    struct Counter {
+        char const * name;
+        uint64_t value;
+    };
+
+    // Values are bucketed by bit length: bucket 0 holds zeros, and bucket b holds values in [2^(b-1), 2^b).
+    struct Histogram {
+        enum { nBuckets = 65 };
+
+        char const * name;
+        uint64_t count, sum, max;
+        uint64_t buckets[nBuckets];
+
+        double mean() const { return count ? double(sum) / count : 0; }
+    };
+
+    // True iff built with METRICS.
+    bool enabled();
+
+    // Every counter and histogram recorded so far, in the order they were first used.
+    std::vector<Counter> counters();
+    std::vector<Histogram> histograms();
+
+    // Zero everything.
+    void reset();
+
+    // Write counters() and histograms() to path as JSON. Returns false if the file can't be written.
+    bool dump(char const * path);
+
+    // Registration and recording, for the macros. Counters and histograms are separate tables of Instrumentation sites.
+    int counter(char const * name);
+    int histogram(char const * name);
+    void add(int counter, uint64_t n);
+    void record(int histogram, uint64_t value);
+
+    // Records the time from construction to destruction into a histogram.
+    class Span {
+    public:
+        explicit Span(int histogram) : histogram_(histogram), start_(std::chrono::steady_clock::now()) { }
+
+        ~Span() {
+            record(histogram_, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count());
+        }
+
+        Span(Span const &) = delete;
+        Span & operator=(Span const &) = delete;
+
+    private:
+        int histogram_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+}
+
+#ifdef METRICS
+#define METRICS_CAT2(a, b) a##b
+#define METRICS_CAT(a, b) METRICS_CAT2(a, b)
+#define METRIC_COUNT(name, n)                                                                       \
+    do {                                                                                            \
+        static int const metricsSite = Metrics::counter(name);                                     \
+        Metrics::add(metricsSite, (n));                                                             \
+    } while (0)
+#define METRIC_HISTOGRAM(name, value)                                                               \
+    do {                                                                                            \
+        static int const metricsSite = Metrics::histogram(name);                                   \
+        Metrics::record(metricsSite, (value));                                                      \
+    } while (0)
+#define METRIC_SPAN(name)                                                                           \
+    static int const METRICS_CAT(metricsSpanSite_, __LINE__) = Metrics::histogram(name);            \
+    Metrics::Span METRICS_CAT(metricsSpan_, __LINE__)(METRICS_CAT(metricsSpanSite_, __LINE__))
+#else
+#define METRIC_COUNT(name, n) ((void)0)
+#define METRIC_HISTOGRAM(name, value) ((void)0)
+#define METRIC_SPAN(name) ((void)0)
+#endif
+
+#endif // INCLUDED__Metrics_h
@@ -0,0 +1,82 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#include "MoveAnalysis.h"
+#include "ScratchPool.h"
+#include "Trace.h"
+
+namespace {
+
+    // Jobs that overlap (one superseded but still winding down, one starting) each take a context of their own.
+    ScratchPool<AnalysisContext> contexts;
+
+}
+
+void MoveAnalysis::start(Board const & board, MoveIndex const & moves, size_t nThreads, Done done, GameState::OnGroup onGroup) {
+    auto token = std::make_shared<Board::Cancel>(false);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (current_)
+            *current_ = true;
+        current_ = token;
+    }
+
+    // The job holds the token, not this, so it is safe to outlive the analysis that started it.
+    auto result = std::make_shared<Result>();
+    result->moves = moves;
+    auto queued = Trace::stamp();
+    executor_.submit(priority_, [=]{
+        if (queued)
+            Trace::complete("MoveAnalysis::queued", queued, Trace::now());
+        TRACE_SPAN("MoveAnalysis::run");
+        if (*token)
+            return;
+
+        auto & index = result->moves;
+        index.cancel = token.get();
+        {
+            TRACE_SPAN("MoveIndex::update");
+            index.update(board, nThreads);
+        }
+        index.cancel = nullptr;
+        if (*token)
+            return;
+
+        GameState::OnGroup stream;
+        if (onGroup)
+            stream = [&](std::shared_ptr<ShapeMatches> const & group) {
+                if (!*token)
+                    onGroup(group);
+            };
+        auto ctx = contexts.take();
+        result->matcheses = GameState::possibleMoves(*ctx, index.pairs(), stream);
+        if (!*token)
+            done(result);
+    });
+}
+
+void MoveAnalysis::Batches::add(std::shared_ptr<ShapeMatches> const & group) {
+    bool schedule;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        groups_.push_back(group);
+        schedule = !scheduled_;
+        scheduled_ = true;
+    }
+    if (schedule)
+        schedule_(shared_from_this());
+}
+
+GameState::ShapeMatcheses MoveAnalysis::Batches::take() {
+    GameState::ShapeMatcheses groups;
+    std::lock_guard<std::mutex> lock(mutex_);
+    scheduled_ = false;
+    groups.swap(groups_);
+    return groups;
+}
+
+void MoveAnalysis::cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (current_)
+        *current_ = true;
+    current_.reset();
+}
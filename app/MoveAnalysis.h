@@ -0,0 +1,77 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__MoveAnalysis_h
+#define INCLUDED__MoveAnalysis_h
+
+#import "GameState.h"
+#import "MoveIndex.h"
+#import "Executor.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+// Background move analysis for one game. Each start() supersedes the analysis before it: if that one hasn't started,
+// it never will, and if it is searching, the search is cancelled between seed pairs. A burst of board changes thus
+// costs about one analysis, not one per change, and the latest result arrives about one analysis after the last
+// change.
+class MoveAnalysis {
+public:
+    struct Result {
+        MoveIndex moves;
+        GameState::ShapeMatcheses matcheses;
+    };
+
+    // Called on an executor thread, unless the analysis is superseded or cancelled before it finishes. It can still
+    // be superseded while done runs, so callers that care check for a newer analysis themselves.
+    typedef std::function<void(std::shared_ptr<Result> const &)> Done;
+
+    explicit MoveAnalysis(Executor & executor = Executor::shared(), Executor::Priority priority = Executor::low)
+    : executor_(executor), priority_(priority) { }
+
+    ~MoveAnalysis() { cancel(); }
+
+    MoveAnalysis(MoveAnalysis const &) = delete;
+    MoveAnalysis & operator=(MoveAnalysis const &) = delete;
+
+    // Analyse board, starting from moves if it is ready for board or only lacks the cells it has noted as cleared (it
+    // is searched in full otherwise). If given, onGroup gets each group of the result as soon as it is final, on an
+    // executor thread, before done is called. No group is final until the search is over, so groups only save the
+    // time it takes to group the rest, not the search.
+    void start(Board const & board, MoveIndex const & moves, size_t nThreads, Done done,
+               GameState::OnGroup onGroup = nullptr);
+
+    // Drop the current analysis, if any.
+    void cancel();
+
+    // Hands the groups of an analysis over to another thread in batches rather than one at a time. The first group
+    // to arrive after the last take() calls schedule with this, which should arrange for take() to be called on the
+    // other thread; take() returns every group that has arrived since. An analysis makes up to thousands of groups, and
+    // this way the thread taking them sees one hop per batch however many there are. Make them with make_shared.
+    class Batches : public std::enable_shared_from_this<Batches> {
+    public:
+        typedef std::function<void(std::shared_ptr<Batches> const &)> Schedule;
+
+        explicit Batches(Schedule schedule) : schedule_(std::move(schedule)) { }
+
+        // For onGroup.
+        void add(std::shared_ptr<ShapeMatches> const & group);
+
+        GameState::ShapeMatcheses take();
+
+    private:
+        Schedule schedule_;
+        std::mutex mutex_;
+        GameState::ShapeMatcheses groups_;
+        bool scheduled_ = false;
+    };
+
+private:
+    Executor & executor_;
+    Executor::Priority priority_;
+    std::mutex mutex_;
+    std::shared_ptr<Board::Cancel> current_;
+};
+
+#endif // INCLUDED__MoveAnalysis_h
@@ -0,0 +1,65 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#include "MoveIndex.h"
+
+#include <cassert>
+
+using namespace brac;
+
+void MoveIndex::reset(Board const & board, size_t nThreads) {
+    board_ = board;
+    pairs_ = board.findMatchingPairs(nullptr, nThreads, engine, cancel);
+    pending_ = BitBoard::empty();
+    ready_ = !(cancel && *cancel);
+    transforms_.clear();
+    if (ready_)
+        addTransforms(pairs_);
+}
+
+void MoveIndex::update(Board const & board, size_t nThreads) {
+    if (ready() && board_ == board)
+        return;
+    if (!ready_ || !((board_ & ~pending_) == board))
+        return reset(board, nThreads);
+
+    auto const cleared = pending_;
+    assert(!(board.computeMask() & cleared));
+
+    for (auto i = begin(pairs_); i != end(pairs_);)
+        if (((*i)[0] | (*i)[1]) & cleared) {
+            transforms_.erase(*i);
+            i = pairs_.erase(i);
+        } else {
+            ++i;
+        }
+
+    auto near = board.findMatchingPairsNear(cleared, nullptr, nThreads, engine, cancel);
+    pairs_.insert(begin(near), end(near));
+    board_ = board;
+    pending_ = BitBoard::empty();
+    if (cancel && *cancel) {
+        ready_ = false;
+        return;
+    }
+    addTransforms(near);
+
+    if (check && !verify())
+        ++mismatches;
+}
+
+void MoveIndex::addTransforms(Board::Pairs const & pairs) {
+    for (auto const & p : pairs)
+        transforms_[p] = {{board_.transformOnto(p[0], p[1]), board_.transformOnto(p[1], p[0])}};
+}
+
+bool MoveIndex::verify(std::ostream & os) const {
+    auto full = board_.findMatchingPairs(nullptr, 1, engine);
+    if (full == pairs_)
+        return true;
+
+    size_t missing = std::count_if(begin(full), end(full), [&](std::array<BitBoard, 2> const & p) { return !pairs_.count(p); });
+    size_t extra = std::count_if(begin(pairs_), end(pairs_), [&](std::array<BitBoard, 2> const & p) { return !full.count(p); });
+    os << "Move index has " << pairs_.size() << " pairs; full search found " << full.size() << " ("
+       << missing << " missing, " << extra << " extra)\n";
+    return false;
+}
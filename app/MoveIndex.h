@@ -0,0 +1,62 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__MoveIndex_h
+#define INCLUDED__MoveIndex_h
+
+#import "Board.h"
+
+#include <bricabrac/Math/BitBoard.h>
+
+#include <iostream>
+
+// The maximal matching pairs on a board, kept up to date as cells are cleared. A match only ever removes dots, so
+// rather than searching the whole board again, the index notes the cleared cells and update() later drops the pairs
+// that used them and searches only around them. Noting is cheap enough for the UI thread; the update is a search,
+// so it belongs on a background one.
+class MoveIndex {
+public:
+    MoveIndex() : board_(0) { }
+
+    // True iff pairs() are board()'s and no cells have been noted as cleared since.
+    bool                    ready() const { return ready_ && !pending_; }
+    Board           const & board() const { return board_; }
+    Board::Pairs    const & pairs() const { return pairs_; }
+
+    // Each pair, with the transforms that carry each half onto the other (Board::transformOnto()). Found along with
+    // the pairs, so that readers on the UI thread needn't work them out.
+    typedef FlatHashMap<std::array<brac::BitBoard, 2>, std::array<brac::BitBoard::ShiftRotate, 2>> Transforms;
+    Transforms      const & transforms() const { return transforms_; }
+
+    // Full search.
+    void reset(Board const & board, size_t nThreads = 1);
+
+    // Note that the cells in cleared have gone from board(). The pairs are left as they are until update().
+    void cleared(brac::BitBoard const & cleared) { pending_ |= cleared; }
+
+    // Bring the index up to date with board. If board is board() minus the cells noted by cleared(), only around them
+    // is searched; otherwise it falls back to a full search. Does nothing if the index is ready for board already.
+    void update(Board const & board, size_t nThreads = 1);
+
+    // Compare the index with a full search, reporting any difference to os. Returns true iff they agree.
+    bool verify(std::ostream & os = std::cerr) const;
+
+    Board::Engine engine = Board::Engine::adaptive;
+
+    // If set, searches give up once it is, leaving the index not ready.
+    Board::Cancel const * cancel = nullptr;
+
+    // Check mode: verify after every incremental update. Costs a full search per update.
+    bool check = false;
+    size_t mismatches = 0;
+
+private:
+    Board board_;
+    Board::Pairs pairs_;
+    Transforms transforms_;
+    brac::BitBoard pending_ = brac::BitBoard::empty();
+    bool ready_ = false;
+
+    void addTransforms(Board::Pairs const & pairs);
+};
+
+#endif // INCLUDED__MoveIndex_h
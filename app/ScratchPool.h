@@ -0,0 +1,42 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__ScratchPool_h
+#define INCLUDED__ScratchPool_h
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A stash of reusable scratch objects. take() hands back an object returned by an earlier caller when there is one,
+// so containers that are cleared rather than destroyed keep their capacity from one call to the next. Objects come
+// back as they were left; callers clear what they use.
+template <typename T>
+class ScratchPool {
+public:
+    struct Return {
+        ScratchPool * pool;
+        void operator()(T * t) const { pool->give(t); }
+    };
+
+    typedef std::unique_ptr<T, Return> Ptr;
+
+    Ptr take() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.empty())
+            return Ptr(new T, Return{this});
+        Ptr t(free_.back().release(), Return{this});
+        free_.pop_back();
+        return t;
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<T>> free_;
+
+    void give(T * t) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.emplace_back(t);
+    }
+};
+
+#endif // INCLUDED__ScratchPool_h
@@ -0,0 +1,107 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#include "SelectionBorder.h"
+
+#include <algorithm>
+
+using namespace brac;
+
+namespace {
+
+    using SelectionBorder::Vertex;
+
+    vec2 const Ci{0, 0}, I{0.25, 0.25}, Cs{0.25, 0}, S{0.5, 0.25}, Co{0.5, 0}, O{0.75, 0.25};
+    vec2 const texcoords[] = {Cs, O, S, I, I};
+
+    enum CornerType { none, outer, straight, inner, own_inner };
+
+    CornerType cornerType(bool cw, bool diag, bool ccw) {
+        switch (cw + 2*diag + 4*ccw) {
+            case 0 : return outer;
+            case 1 : return straight;
+            case 2 : return outer;
+            case 3 : return inner;
+            case 4 : return straight;
+            case 5 : return own_inner;
+            case 6 : return inner;
+            default: return none;
+        }
+    }
+
+    // Emit the eight triangles of the cell centred on c, given its neighbours, through triangle(a, b, c, edge, corner).
+    template <typename Triangle>
+    void fan(vec2 c, bool SW, bool S, bool SE, bool W, bool E, bool NW, bool N, bool NE, Triangle triangle) {
+        CornerType SWc = cornerType(W, SW, S);
+        CornerType SEc = cornerType(S, SE, E);
+        CornerType NEc = cornerType(E, NE, N);
+        CornerType NWc = cornerType(N, NW, W);
+
+        // Edge types
+        CornerType Ne = N ? none : straight;
+        CornerType Se = S ? none : straight;
+        CornerType Ee = E ? none : straight;
+        CornerType We = W ? none : straight;
+
+        triangle(c, c + vec2{-0.5,  0   }, c + vec2{-0.5, -0.5}, We, SWc);
+        triangle(c, c + vec2{-0.5,  0   }, c + vec2{-0.5,  0.5}, We, NWc);
+        triangle(c, c + vec2{ 0   , -0.5}, c + vec2{ 0.5, -0.5}, Se, SEc);
+        triangle(c, c + vec2{ 0   , -0.5}, c + vec2{-0.5, -0.5}, Se, SWc);
+        triangle(c, c + vec2{ 0.5,  0   }, c + vec2{ 0.5, -0.5}, Ee, SEc);
+        triangle(c, c + vec2{ 0.5,  0   }, c + vec2{ 0.5,  0.5}, Ee, NEc);
+        triangle(c, c + vec2{ 0   ,  0.5}, c + vec2{ 0.5,  0.5}, Ne, NEc);
+        triangle(c, c + vec2{ 0   ,  0.5}, c + vec2{-0.5,  0.5}, Ne, NWc);
+    }
+
+    // The three vertices of one triangle, with b and c swapped if swap is set.
+    template <typename Out>
+    void emit(Out out, vec2 a, vec2 b, vec2 c, CornerType edge, CornerType corner, bool swap) {
+        Vertex vs[] = {
+            {a, corner == own_inner && edge == none ? Ci : Co},
+            {b, texcoords[edge]},
+            {c, texcoords[corner]},
+        };
+        if (swap)
+            std::swap(vs[1], vs[2]);
+        std::copy(std::begin(vs), std::end(vs), out);
+    }
+
+    struct Cells {
+        std::array<SelectionBorder::Cell, 256> cells;
+
+        Cells() {
+            for (unsigned hood = 0; hood < 256; ++hood) {
+                auto out = begin(cells[hood]);
+                fan(vec2{0, 0}, hood & 1, hood & 2, hood & 4, hood & 8, hood & 16, hood & 32, hood & 64, hood & 128,
+                    [&](vec2 a, vec2 b, vec2 c, CornerType edge, CornerType corner) {
+                        emit(out, a, b, c, edge, corner, cross(b, c) < 0);
+                        out += 3;
+                    });
+            }
+        }
+    };
+
+}
+
+namespace SelectionBorder {
+
+    Cell const & cell(unsigned hood) {
+        static Cells const cells;
+        return cells.cells[hood];
+    }
+
+    void meshReference(BitBoard const & bb, int nCols, int nRows, std::vector<Vertex> & out) {
+        out.clear();
+        for (int y = 0; y < nRows; ++y)
+            for (int x = 0; x < nCols; ++x) {
+                vec2 c{0.5f + x, 0.5f + y};
+                uint64_t hood = bb.shiftWS(x - 1, y - 1).a;
+                if (hood & (2ULL<<16))
+                    fan(c, hood & 1ULL, hood & 2ULL, hood & 4ULL, hood & (1ULL<<16), hood & (4ULL<<16),
+                        hood & (1ULL<<32), hood & (2ULL<<32), hood & (4ULL<<32),
+                        [&](vec2 a, vec2 b, vec2 c, CornerType edge, CornerType corner) {
+                            emit(back_inserter(out), a, b, c, edge, corner, cross(b, c) < 0);
+                        });
+            }
+    }
+
+}
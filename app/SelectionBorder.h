@@ -0,0 +1,63 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__SelectionBorder_h
+#define INCLUDED__SelectionBorder_h
+
+#include <bricabrac/Math/BitBoard.h>
+#include <bricabrac/Math/vec2.h>
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// The mesh that outlines a selection: eight triangles per selected cell, fanned from its centre to the midpoints and
+// corners of its sides, with texture coordinates into the border atlas that depend on which neighbours are selected
+// too. Positions are in cells, with cell (x, y) spanning [x, x + 1] × [y, y + 1].
+namespace SelectionBorder {
+
+    struct Vertex {
+        brac::vec2 position, texcoord;
+    };
+
+    enum { verticesPerCell = 24 };
+
+    typedef std::array<Vertex, verticesPerCell> Cell;
+
+    // The triangles of a cell centred on the origin, given which of its neighbours are selected (see hood()). There are
+    // only 256 cases, so they are worked out once.
+    Cell const & cell(unsigned hood);
+
+    // The eight neighbours of cell (x, y) in a board's words, as bits SW, S, SE, W, E, NW, N, NE from the lowest.
+    inline unsigned hood(uint64_t const (&words)[4], int x, int y) {
+        auto row = [&](int y) -> unsigned {
+            return y < 0 || y > 15 ? 0 : ((unsigned(words[y >> 2] >> (16 * (y & 3))) & 0xffff) << 1 >> x) & 7;
+        };
+        unsigned s = row(y - 1), m = row(y), n = row(y + 1);
+        return s | (m & 1) << 3 | (m >> 2) << 4 | n << 5;
+    }
+
+    // Replace out with the mesh of bb. Only selected cells are visited, each copying its triangles from cell(). out is
+    // resized, not rebuilt, so a buffer reused from one selection to the next stops allocating once it has held the
+    // largest. V must be constructible as V{position, texcoord}, so the renderer's vertex type can be filled directly.
+    template <typename V>
+    void mesh(brac::BitBoard const & bb, std::vector<V> & out) {
+        uint64_t const words[4] = {bb.a, bb.b, bb.c, bb.d};
+        out.resize(verticesPerCell * bb.count());
+        auto o = out.data();
+        for (int w = 0; w < 4; ++w)
+            for (uint64_t bits = words[w]; bits; bits &= bits - 1) {
+                int i = 64 * w + __builtin_ctzll(bits), x = i & 15, y = i >> 4;
+                brac::vec2 c{0.5f + x, 0.5f + y};
+                for (auto const & v : cell(hood(words, x, y)))
+                    *o++ = V{c + v.position, v.texcoord};
+            }
+    }
+
+    // The original mesher, which visits every cell of an nCols × nRows board and works each one out afresh. It is the
+    // reference that mesh() is checked against, and makes the same triangles in the same order, though not always with
+    // the same winding (the border is drawn without culling).
+    void meshReference(brac::BitBoard const & bb, int nCols, int nRows, std::vector<Vertex> & out);
+
+}
+
+#endif // INCLUDED__SelectionBorder_h
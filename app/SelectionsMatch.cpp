@@ -0,0 +1,225 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#include "Board.h"
+#include "ColorCount.h"
+
+#include <cassert>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define SELECTIONS_MATCH_AVX2
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace brac;
+
+// A BitBoard is a 256-bit number with cell (x, y) at bit 16*y + x. No cell of a selection lies below bit
+// 16*marginS + marginW, so shifting each color plane of a selection down by that many bits moves the selection to the
+// origin without wrapping or losing any cells. That is one funnel shift per plane instead of a shiftWS, and it is the
+// same shift for every plane of one orientation, so the kernels below compare all colors of an orientation in one
+// step and give up on it at the first difference.
+
+namespace {
+
+    // Bit offset of the origin of b rotated by k quarter turns, from b's margins.
+    void origins(BitBoard const & b, unsigned (&offset)[4]) {
+        int nm = b.marginN(), sm = b.marginS(), em = b.marginE(), wm = b.marginW();
+        offset[0] = 16 * sm + wm;
+        offset[1] = 16 * wm + nm;
+        offset[2] = 16 * nm + em;
+        offset[3] = 16 * em + sm;
+    }
+
+    BitBoard rotate(BitBoard const & bb, int k) {
+        switch (k) {
+            case 1 : return bb.rotL();
+            case 2 : return bb.reverse();
+            case 3 : return bb.rotR();
+            default: return bb;
+        }
+    }
+
+#ifdef SELECTIONS_MATCH_AVX2
+
+    __attribute__((target("avx2")))
+    __m256i load(BitBoard const & bb) {
+        return _mm256_set_epi64x(bb.d, bb.c, bb.b, bb.a);
+    }
+
+    // Word j + q of x in word j, with zeros above.
+    __attribute__((target("avx2")))
+    __m256i words(__m256i x, unsigned q) {
+        __m256i lane = _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(2 * q));
+        __m256i keep = _mm256_cmpgt_epi32(_mm256_set1_epi32(8), lane);
+        return _mm256_and_si256(_mm256_permutevar8x32_epi32(x, lane), keep);
+    }
+
+    // x >> n as a 256-bit number. An empty selection's origin is past the top, which gives 0.
+    __attribute__((target("avx2")))
+    __m256i shiftDown(__m256i x, unsigned n) {
+        unsigned q = n / 64, k = n % 64;
+        __m256i lo = _mm256_srl_epi64(words(x, q    ), _mm_cvtsi32_si128(k     ));
+        __m256i hi = _mm256_sll_epi64(words(x, q + 1), _mm_cvtsi32_si128(64 - k));     // Shifts of 64 give 0.
+        return _mm256_or_si256(lo, hi);
+    }
+
+    template <size_t N>
+    struct SelectionsMatchAVX2 {
+        __attribute__((target("avx2")))
+        static bool run(Board const (&prerotated)[4], BitBoard const & a, BitBoard const & b) {
+            size_t const nColors = colorCount<N>(prerotated[0]);
+            unsigned offset[4];
+            origins(b, offset);
+
+            __m256i as[Board::maxColors];
+            __m256i va = load(a);
+            for (size_t i = 0; i < nColors; ++i)
+                as[i] = shiftDown(_mm256_and_si256(load(prerotated[0].colors[i]), va), 16 * a.marginS() + a.marginW());
+
+            for (int r = 0; r < 4; ++r) {
+                __m256i vb = load(rotate(b, r)), diff = _mm256_setzero_si256();
+                for (size_t i = 0; i < nColors; ++i) {
+                    __m256i bs = shiftDown(_mm256_and_si256(load(prerotated[r].colors[i]), vb), offset[r]);
+                    diff = _mm256_or_si256(diff, _mm256_xor_si256(as[i], bs));
+                }
+                if (_mm256_testz_si256(diff, diff))
+                    return true;
+            }
+            return false;
+        }
+    };
+
+    bool haveAVX2() {
+#ifdef __AVX2__
+        return true;
+#else
+        static bool const have = __builtin_cpu_supports("avx2");
+        return have;
+#endif
+    }
+
+#endif
+
+#if defined(__ARM_NEON)
+
+    // A BitBoard's words, low first, with zeros above so that loads for shifts past the top (up to an empty
+    // selection's origin) read zeros.
+    struct Words {
+        uint64_t w[10];
+
+        explicit Words(BitBoard const & bb) : w{bb.a, bb.b, bb.c, bb.d} { }
+
+        // The low and high halves of bb >> n.
+        void shiftDown(unsigned n, uint64x2_t & lo, uint64x2_t & hi) const {
+            unsigned q = n / 64;
+            int64x2_t right = vdupq_n_s64(-static_cast<int64_t>(n % 64)), left = vdupq_n_s64(64 - n % 64);
+            lo = vorrq_u64(vshlq_u64(vld1q_u64(w + q    ), right), vshlq_u64(vld1q_u64(w + q + 1), left));
+            hi = vorrq_u64(vshlq_u64(vld1q_u64(w + q + 2), right), vshlq_u64(vld1q_u64(w + q + 3), left));
+        }
+    };
+
+    template <size_t N>
+    struct SelectionsMatchNEON {
+        static bool run(Board const (&prerotated)[4], BitBoard const & a, BitBoard const & b) {
+            size_t const nColors = colorCount<N>(prerotated[0]);
+            unsigned offset[4];
+            origins(b, offset);
+
+            uint64x2_t alo[Board::maxColors], ahi[Board::maxColors];
+            for (size_t i = 0; i < nColors; ++i)
+                Words(prerotated[0].colors[i] & a).shiftDown(16 * a.marginS() + a.marginW(), alo[i], ahi[i]);
+
+            for (int r = 0; r < 4; ++r) {
+                auto br = rotate(b, r);
+                uint64x2_t diff = vdupq_n_u64(0);
+                for (size_t i = 0; i < nColors; ++i) {
+                    uint64x2_t lo, hi;
+                    Words(prerotated[r].colors[i] & br).shiftDown(offset[r], lo, hi);
+                    diff = vorrq_u64(diff, vorrq_u64(veorq_u64(alo[i], lo), veorq_u64(ahi[i], hi)));
+                }
+                if (!(vgetq_lane_u64(diff, 0) | vgetq_lane_u64(diff, 1)))
+                    return true;
+            }
+            return false;
+        }
+    };
+
+#endif
+
+}
+
+char const * Board::selectionsMatchKernel() {
+#if defined(__ARM_NEON)
+    return "neon";
+#elif defined(SELECTIONS_MATCH_AVX2)
+    return haveAVX2() ? "avx2" : "scalar";
+#else
+    return "scalar";
+#endif
+}
+
+bool Board::selectionsMatch(Board const (&prerotated)[4], BitBoard const & a, BitBoard const & b, ColorLoops loops) {
+#if defined(__ARM_NEON)
+    return withColorCount<SelectionsMatchNEON>(loops, prerotated[0].nColors(), prerotated, a, b);
+#elif defined(SELECTIONS_MATCH_AVX2)
+    if (haveAVX2())
+        return withColorCount<SelectionsMatchAVX2>(loops, prerotated[0].nColors(), prerotated, a, b);
+#endif
+    return selectionsMatchScalar(prerotated, a, b);
+}
+
+bool Board::selectionsMatchScalar(Board const (&prerotated)[4], BitBoard const & a, BitBoard const & b)
+{
+    size_t nColors = prerotated[0].nColors();
+
+    assert(std::all_of(std::begin(prerotated) + 1, std::end(prerotated),
+                       [&](Board const & b) { return b.nColors() == nColors; }));
+
+    int sm1 = a.marginS(), wm1 = a.marginW();
+
+    BitBoard * cc = new (alloca(nColors * sizeof(BitBoard))) BitBoard[nColors];
+    uint32_t cc_set = 0;
+
+    auto lazyColorA = [&](size_t i) -> BitBoard const & {
+        uint32_t m = 1 << i;
+        if (!(cc_set & m)) {
+            cc[i] = (prerotated[0].colors[i] & a).shiftWS(wm1, sm1);
+            cc_set |= m;
+        }
+        return cc[i];
+    };
+
+    int nm = b.marginN(), sm = b.marginS(), em = b.marginE(), wm = b.marginW();
+
+    for (size_t i = 0; i < nColors; ++i)
+        if (lazyColorA(i) != (prerotated[0].colors[i] & b).shiftWS(wm, sm))
+            goto b1;
+    return true;
+
+b1:
+    auto b1 = b.rotL();
+    for (size_t i = 0; i < nColors; ++i)
+        if (lazyColorA(i) != (prerotated[1].colors[i] & b1).shiftWS(nm, wm))
+            goto b2;
+    return true;
+
+b2:
+    auto b2 = b.reverse();
+    for (size_t i = 0; i < nColors; ++i)
+        if (lazyColorA(i) != (prerotated[2].colors[i] & b2).shiftWS(em, nm))
+            goto b3;
+    return true;
+
+b3:
+    auto b3 = b.rotR();
+    for (size_t i = 0; i < nColors; ++i)
+        if (lazyColorA(i) != (prerotated[3].colors[i] & b3).shiftWS(sm, em))
+            goto b4;
+    return true;
+
+b4:
+    return false;
+}
@@ -0,0 +1,171 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#include "TouchTrace.h"
+#include "FlatHash.h"
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <thread>
+
+namespace {
+
+    char const tag[4] = {'T', 'T', 'R', '1'};
+
+    void put(std::ostream & os, uint64_t n) {
+        for (; n >= 0x80; n >>= 7)
+            os.put(static_cast<char>(n | 0x80));
+        os.put(static_cast<char>(n));
+    }
+
+    bool get(std::istream & is, uint64_t & n) {
+        n = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int c = is.get();
+            if (c == std::char_traits<char>::eof())
+                return false;
+            n |= uint64_t(c & 0x7f) << shift;
+            if (!(c & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+}
+
+void TouchTrace::write(std::ostream & os) const {
+    os.write(tag, sizeof tag);
+    for (size_t n : {seed, nColors, width, height})
+        put(os, n);
+    uint64_t last = 0;
+    for (auto const & e : events) {
+        put(os, e.us - last);
+        last = e.us;
+        put(os, static_cast<uint64_t>(e.input));
+        put(os, e.touches.size());
+        for (auto const & t : e.touches) {
+            put(os, 2 * uint64_t(t.key) + t.hasMoved);
+            os.put(static_cast<char>(t.x + 16 * t.y));
+        }
+    }
+}
+
+bool TouchTrace::read(std::istream & is) {
+    char t[sizeof tag];
+    if (!is.read(t, sizeof t) || !std::equal(std::begin(t), std::end(t), tag))
+        return false;
+    uint64_t header[4];
+    for (auto & n : header)
+        if (!get(is, n))
+            return false;
+    seed = header[0];
+    nColors = header[1];
+    width = header[2];
+    height = header[3];
+    if (nColors < 2 || nColors > Board::maxColors || !width || width > 16 || !height || height > 16)
+        return false;
+
+    events.clear();
+    uint64_t us = 0, dt;
+    while (get(is, dt)) {
+        uint64_t input, n;
+        if (!get(is, input) || input >= uint64_t(GameState::Input::nInputs) || !get(is, n) || n > 256)
+            return false;
+        Event e{us += dt, static_cast<GameState::Input>(input), {}};
+        for (uint64_t i = 0; i < n; ++i) {
+            uint64_t key;
+            int cell;
+            if (!get(is, key) || key >> 33 || (cell = is.get()) == std::char_traits<char>::eof())
+                return false;
+            e.touches.push_back(Touch{uint32_t(key >> 1), uint8_t(cell & 15), uint8_t(cell >> 4), !!(key & 1)});
+        }
+        events.push_back(std::move(e));
+    }
+    return is.eof();
+}
+
+TouchRecorder::TouchRecorder(GameState & game) : start_(std::chrono::steady_clock::now()) {
+    trace_.seed = game.seed();
+    trace_.nColors = game.board().nColors();
+    trace_.width = game.width();
+    trace_.height = game.height();
+    connection_ = game.onInput.connect([this](GameState::Input input, std::vector<GameState::Touch> const & touches) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_).count();
+        TouchTrace::Event e{static_cast<uint64_t>(us), input, {}};
+        e.touches.reserve(touches.size());
+        for (auto const & t : touches) {
+            uint32_t key = 0;
+            if (t.key)
+                key = keys_.emplace(t.key, static_cast<uint32_t>(keys_.size() + 1)).first->second;
+            e.touches.push_back(TouchTrace::Touch{key, uint8_t(t.p.x), uint8_t(t.p.y), t.hasMoved});
+        }
+        trace_.events.push_back(std::move(e));
+    });
+}
+
+TouchReplay::Result TouchReplay::run(TouchTrace const & trace, bool realTime, bool moves) {
+    typedef std::chrono::steady_clock Clock;
+
+    size_t seed = trace.seed;
+    GameState game(trace.nColors, trace.width, trace.height, &seed);
+    if (moves) {
+        MoveIndex index;
+        index.reset(game.board());
+        game.setMoves(index);
+    }
+
+    // Any distinct addresses will do for keys.
+    uint32_t nKeys = 0;
+    for (auto const & e : trace.events)
+        for (auto const & t : e.touches)
+            nKeys = std::max(nKeys, t.key + 1);
+    std::vector<char> keys(nKeys);
+
+    Result result;
+    std::vector<GameState::Touch> touches;
+    auto start = Clock::now();
+    for (auto const & e : trace.events) {
+        if (realTime)
+            std::this_thread::sleep_until(start + std::chrono::microseconds(e.us));
+
+        touches.clear();
+        for (auto const & t : e.touches)
+            touches.push_back(GameState::Touch{t.key ? &keys[t.key] : nullptr,
+                                               brac::vec2{static_cast<float>(t.x), static_cast<float>(t.y)}, t.hasMoved});
+
+        auto t0 = Clock::now();
+        bool incomplete;
+        switch (e.input) {
+            case GameState::Input::touchesBegan    : game.touchesBegan    (touches); break;
+            case GameState::Input::touchesMoved    : game.touchesMoved    (touches); break;
+            case GameState::Input::touchesEnded    : game.touchesEnded    (touches); break;
+            case GameState::Input::touchesCancelled: game.touchesCancelled(touches); break;
+            case GameState::Input::tapped          : for (auto const & t : touches) game.tapped(t.p); break;
+            default                                : result.matches += game.match(incomplete); break;
+        }
+        result.us[size_t(e.input)].push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+
+        // The app brings its moves up to date after a match on the executor, off the timed path.
+        if (moves && !game.moves().ready()) {
+            MoveIndex index = game.moves();
+            index.update(game.board());
+            game.setMoves(index);
+        }
+    }
+    result.stateHash = stateHash(game);
+    return result;
+}
+
+size_t TouchReplay::stateHash(GameState const & game) {
+    auto const & board = game.board();
+    size_t h = hashWords({board.nColors(), game.width(), game.height()});
+    for (size_t c = 0; c < board.nColors(); ++c)
+        h = hashWords({h, board.colors[c].a, board.colors[c].b, board.colors[c].c, board.colors[c].d});
+
+    // Selections are visited in index order.
+    for (auto const & sel : game.sels()) {
+        auto const & s = sel.second;
+        h = hashWords({h, sel.first, s.is_selected.a, s.is_selected.b, s.is_selected.c, s.is_selected.d, s.has_border()});
+    }
+    return h;
+}
@@ -0,0 +1,78 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__TouchTrace_h
+#define INCLUDED__TouchTrace_h
+
+#include "GameState.h"
+
+#include <boost/signals2.hpp>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <unordered_map>
+#include <vector>
+
+// Everything a game was told, with when, so that it can be played again off the device. A game is fully determined by
+// its seed, size and color count and by its inputs, so replaying a trace into a fresh game ends in the same state.
+//
+// Traces are saved in a compact binary form: a "TTR1" tag, then the game's seed, color count, width and height, then
+// one record per input. All integers are unsigned LEB128. A record is the µs since the previous input, the input, the
+// number of touches and, per touch, its key number times two plus hasMoved, then its cell as x + 16y in a byte.
+struct TouchTrace {
+    struct Touch {
+        uint32_t key;   // Keys are numbered in order of first appearance; 0 is reserved for taps.
+        uint8_t x, y;
+        bool hasMoved;
+    };
+
+    struct Event {
+        uint64_t us;    // Since recording began.
+        GameState::Input input;
+        std::vector<Touch> touches;
+    };
+
+    size_t seed = 0, nColors = 0, width = 0, height = 0;
+    std::vector<Event> events;
+
+    void write(std::ostream & os) const;
+
+    // Returns false, leaving this in an unspecified state, if is doesn't hold a whole trace.
+    bool read(std::istream & is);
+};
+
+// Records a game's inputs into a trace while it lives. Attach it as soon as the game is made; a trace that starts with
+// selections already in play won't replay to the same state.
+class TouchRecorder {
+public:
+    explicit TouchRecorder(GameState & game);
+
+    TouchTrace const & trace() const { return trace_; }
+
+private:
+    TouchTrace trace_;
+    std::chrono::steady_clock::time_point start_;
+    std::unordered_map<void const *, uint32_t> keys_;
+    boost::signals2::scoped_connection connection_;
+};
+
+// Plays a trace into a fresh game, on this thread, timing how long the game takes to handle each input.
+class TouchReplay {
+public:
+    struct Result {
+        std::array<std::vector<double>, size_t(GameState::Input::nInputs)> us;  // Per input, in trace order.
+        size_t matches = 0;     // Successful match() calls.
+        size_t stateHash = 0;   // stateHash() of the game at the end.
+    };
+
+    // If realTime is set, inputs are spaced out as they were recorded; otherwise they follow each other at once. With
+    // moves set, the game is given a move index up front, as the app's first analysis would, so match() keeps it up to
+    // date.
+    static Result run(TouchTrace const & trace, bool realTime = false, bool moves = true);
+
+    // A digest of what the player can see: the board and each selection's cells and border.
+    static size_t stateHash(GameState const & game);
+};
+
+#endif // INCLUDED__TouchTrace_h
@@ -0,0 +1,147 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#include "Trace.h"
+
+#include "Instrumentation.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+    struct Event {
+        char const * name;
+        int64_t begin, end;
+    };
+
+    // One thread's events. Only its thread writes it; n counts every event ever recorded, so the ring holds the last
+    // min(n, capacity) of them.
+    struct Ring {
+        enum { capacity = 1 << 14 };
+
+        int tid;
+        std::atomic<uint64_t> n{0};
+        Event events[capacity];
+    };
+
+    // Rings outlive their threads, since the events in them still have to be written out. A thread that exits hands
+    // its ring to the next thread that records, which then shows on the same row; short-lived threads, such as the
+    // benchmark's, thus share a few rings rather than each leaving one behind.
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Ring>> rings;
+        std::vector<Ring *> idle;
+    };
+
+    // Never destroyed, so that threads still running at exit can hand their rings back.
+    Registry & registry() {
+        static Registry * r = new Registry;
+        return *r;
+    }
+
+    struct Holder {
+        Ring * ring = nullptr;
+
+        Ring & get() {
+            if (!ring) {
+                auto & r = registry();
+                std::lock_guard<std::mutex> lock(r.mutex);
+                if (!r.idle.empty()) {
+                    ring = r.idle.back();
+                    r.idle.pop_back();
+                } else {
+                    r.rings.emplace_back(new Ring);
+                    ring = r.rings.back().get();
+                    ring->tid = static_cast<int>(r.rings.size());
+                }
+            }
+            return *ring;
+        }
+
+        ~Holder() {
+            if (ring) {
+                auto & r = registry();
+                std::lock_guard<std::mutex> lock(r.mutex);
+                r.idle.push_back(ring);
+            }
+        }
+    };
+
+    thread_local Holder holder;
+
+    // Trace from launch if asked to.
+    Instrumentation::DumpAtExit dumpAtExit{"TRACE_DUMP", [](char const * path) {
+        Trace::stop();
+        return Trace::write(path);
+    }, Trace::start};
+
+}
+
+namespace Trace {
+
+    std::atomic<bool> on{false};
+
+    void start() {
+        on = true;
+    }
+
+    void stop() {
+        on = false;
+    }
+
+    void clear() {
+        auto & r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (auto & ring : r.rings)
+            ring->n = 0;
+    }
+
+    bool write(char const * path) {
+        std::FILE * f = std::fopen(path, "w");
+        if (!f)
+            return false;
+
+        auto & r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+
+        // Times are in µs from the earliest event, which keeps them short and exact.
+        int64_t origin = INT64_MAX;
+        for (auto const & ring : r.rings) {
+            uint64_t n = ring->n.load(std::memory_order_acquire);
+            for (uint64_t i = n - std::min<uint64_t>(n, Ring::capacity); i < n; ++i)
+                origin = std::min(origin, ring->events[i % Ring::capacity].begin);
+        }
+
+        bool first = true;
+        std::fprintf(f, "{\"traceEvents\": [");
+        for (auto const & ring : r.rings) {
+            uint64_t n = ring->n.load(std::memory_order_acquire);
+            for (uint64_t i = n - std::min<uint64_t>(n, Ring::capacity); i < n; ++i) {
+                auto const & e = ring->events[i % Ring::capacity];
+                std::fprintf(f, "%s\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                             first ? "" : ",", e.name, ring->tid, (e.begin - origin) * 1e-3, (e.end - e.begin) * 1e-3);
+                first = false;
+            }
+        }
+        std::fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+        return std::fclose(f) == 0;
+    }
+
+    int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void complete(char const * name, int64_t begin, int64_t end) {
+        if (!begin || !enabled())
+            return;
+        auto & ring = holder.get();
+        uint64_t i = ring.n.load(std::memory_order_relaxed);
+        ring.events[i % Ring::capacity] = Event{name, begin, end};
+        ring.n.store(i + 1, std::memory_order_release);
+    }
+
+}
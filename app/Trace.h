@@ -0,0 +1,70 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+#ifndef INCLUDED__Trace_h
+#define INCLUDED__Trace_h
+
+#include <atomic>
+#include <cstdint>
+
+// A timeline of what the game was doing and on which thread, for working out where a slow move went. Between start()
+// and stop(), TRACE_SPAN("name") records when the rest of its block began and ended. Each thread appends to a ring
+// buffer of its own, so recording takes no lock, and a ring that fills overwrites its oldest events. write() exports
+// everything recorded as Chrome trace JSON, for chrome://tracing or Perfetto.
+//
+// While tracing is off, a span costs one relaxed load and a branch on entry, and one branch on exit, so spans can stay
+// in the touch, match and analysis paths of a release build.
+//
+// Setting TRACE_DUMP to a path in the environment starts tracing at launch and writes the trace there on exit.
+namespace Trace {
+
+    extern std::atomic<bool> on;
+
+    inline bool enabled() { return on.load(std::memory_order_relaxed); }
+
+    void start();
+    void stop();
+
+    // Drop everything recorded so far.
+    void clear();
+
+    // Write the recorded events to path as Chrome trace JSON. Threads should be done recording; an event being
+    // overwritten while it is written out may come out garbled. Returns false if the file can't be written.
+    bool write(char const * path);
+
+    // Nanoseconds on a monotonic clock.
+    int64_t now();
+
+    // now() if tracing, else 0. Marks the start of an interval that ends on another thread or in a later call, such as
+    // time spent queued.
+    inline int64_t stamp() { return enabled() ? now() : 0; }
+
+    // Record an event on this thread's row from begin to end, unless begin is 0 or tracing is off. name must be a
+    // string literal (or otherwise outlive the trace).
+    void complete(char const * name, int64_t begin, int64_t end);
+
+    // Records its lifetime. Whether it will is settled on entry: begin_ stays 0 if tracing is off, and the exit only
+    // checks that.
+    class Span {
+    public:
+        explicit Span(char const * name) : name_(name), begin_(stamp()) { }
+
+        ~Span() {
+            if (begin_)
+                complete(name_, begin_, now());
+        }
+
+        Span(Span const &) = delete;
+        Span & operator=(Span const &) = delete;
+
+    private:
+        char const * name_;
+        int64_t begin_;
+    };
+
+}
+
+#define TRACE_CAT2(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT2(a, b)
+#define TRACE_SPAN(name) Trace::Span TRACE_CAT(traceSpan_, __LINE__)(name)
+
+#endif // INCLUDED__Trace_h
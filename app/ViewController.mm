@@ -1,7 +1,9 @@
 #import "ViewController.h"
 #import "ShapeCell.h"
 #import "Board.h"
+#import "MoveAnalysis.h"
 #import "GameView.h"
+#import "Trace.h"
 #import <bricabrac/Utility/LruCache.h>
 #import <bricabrac/Cocoa/UIAlertView+Blocks.h>
 #import "SettingsController.h"
@@ -11,6 +13,8 @@
 
 #import <QuartzCore/QuartzCore.h>
 
+#include <thread>
+
 static bool iPad = UI_USER_INTERFACE_IDIOM() == UIUserInterfaceIdiomPad;
 
 static constexpr size_t gGrid = 16;
@@ -30,11 +34,13 @@ typedef brac::LruCache<std::tuple<brac::BitBoard, uint8_t, size_t>, UIImage *> S
     std::array<std::array<UIImage *, 5>, 2> _dots;
 
     uint64_t _nUpdates;
+    std::unique_ptr<MoveAnalysis> _analysis;
 }
 
 @property (nonatomic, strong) IBOutlet RenderController * renderer;
 
 - (void)restartGame:(size_t *)seed;
+- (void)reloadTable;
 
 @end
 
@@ -44,22 +50,56 @@ typedef brac::LruCache<std::tuple<brac::BitBoard, uint8_t, size_t>, UIImage *> S
 
 - (void)calculatePossibles {
     auto iUpdate = ++_nUpdates;
-    auto board = _game->board();
-
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
-        auto matcheses = std::make_shared<GameState::ShapeMatcheses>(GameState::possibleMoves(board));
 
+    // Starting an analysis cancels the one before it. After a match, it updates the game's index around the cleared
+    // cells; only a new game needs a full search. The search is sharded over the shared pool, which leaves a core free
+    // and runs below the UI's priority. Groups are final only once the search is over, and then arrive in their final
+    // order while the rest are grouped, so the table fills from the top, a batch per run-loop turn.
+    auto streamed = std::make_shared<GameState::ShapeMatcheses>();
+    auto batches = std::make_shared<MoveAnalysis::Batches>([=](std::shared_ptr<MoveAnalysis::Batches> const & batches) {
+        auto queued = Trace::stamp();
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (queued)
+                Trace::complete("ViewController::groupsQueued", queued, Trace::now());
+            auto groups = batches->take();
+            if (iUpdate != _nUpdates || groups.empty())
+                return;
+            auto first = streamed->size();
+            streamed->insert(end(*streamed), begin(groups), end(groups));
+            if (_matcheses != streamed) {
+                _matcheses = streamed;
+                [self reloadTable];
+            } else {
+                TRACE_SPAN("UITableView insertRows");
+                NSMutableArray * rows = [NSMutableArray arrayWithCapacity:groups.size()];
+                for (auto i = first; i < streamed->size(); ++i)
+                    [rows addObject:[NSIndexPath indexPathForRow:i inSection:0]];
+                [self.tableView insertRowsAtIndexPaths:rows withRowAnimation:UITableViewRowAnimationNone];
+            }
+        });
+    });
+    auto onGroup = [=](std::shared_ptr<ShapeMatches> const & group) { batches->add(group); };
+    _analysis->start(_game->board(), _game->moves(), Executor::shared().nThreads(), [=](std::shared_ptr<MoveAnalysis::Result> const & result) {
+        auto queued = Trace::stamp();
         dispatch_async(dispatch_get_main_queue(), ^{
+            if (queued)
+                Trace::complete("ViewController::resultQueued", queued, Trace::now());
             if (iUpdate == _nUpdates) {
-                if (matcheses->empty()) {
+                _game->setMoves(result->moves);
+                if (_game->moves().pairs().empty()) {
                     [self restartGame:nullptr];
-                } else {
-                    _matcheses = matcheses;
-                    [self.tableView reloadData];
+                } else if (*_matcheses != result->matcheses) {
+                    _matcheses = std::make_shared<GameState::ShapeMatcheses>(result->matcheses);
+                    [self reloadTable];
                 }
             }
         });
-    });
+    }, onGroup);
+}
+
+- (void)reloadTable {
+    TRACE_SPAN("UITableView reloadData");
+    [self.tableView reloadData];
 }
 
 - (UIImage *)makeImageShape:(brac::BitBoard)bb hint:(uint8_t)hint colorSet:(size_t)colorSet outline:(bool)outline {
@@ -168,7 +208,7 @@ typedef brac::LruCache<std::tuple<brac::BitBoard, uint8_t, size_t>, UIImage *> S
                             outline:true];
     }, 1000);
 
-    [self.tableView reloadData];
+    [self reloadTable];
     [self calculatePossibles];
 
     _renderer.paused = NO;
@@ -190,6 +230,7 @@ typedef brac::LruCache<std::tuple<brac::BitBoard, uint8_t, size_t>, UIImage *> S
     _renderer = [self.storyboard instantiateViewControllerWithIdentifier:@"glkView"];
 
     _matcheses = std::make_shared<GameState::ShapeMatcheses>();
+    _analysis.reset(new MoveAnalysis);
 
     {
         UIImage * atlas = [UIImage imageNamed:@"atlas.png"];
@@ -313,13 +354,9 @@ typedef brac::LruCache<std::tuple<brac::BitBoard, uint8_t, size_t>, UIImage *> S
 - (IBAction)tappedMatch {
     bool incomplete;
     if (_game->match(incomplete)) {
+        // The analysis restarts the game if the board has no moves left.
         [self calculatePossibles];
         _renderer.renderer->hint(nullptr);
-        if (_matcheses->empty()) {
-            [self restartGame:nullptr];
-        } else {
-            [self.tableView reloadData];
-        }
     } else if (incomplete) {
         [self performSegueWithIdentifier:@"incomplete" sender:self];
     }
@@ -369,7 +406,7 @@ typedef brac::LruCache<std::tuple<brac::BitBoard, uint8_t, size_t>, UIImage *> S
         settings.toggleColorBlind = [=]() {
             size_t colorSet = 1 - _renderer.renderer->colorSet();
             _renderer.renderer->setColorSet(colorSet);
-            [self.tableView reloadData];
+            [self reloadTable];
             settings.colorBlind = colorSet;
             _renderer.paused = NO;
         };
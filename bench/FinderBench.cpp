@@ -0,0 +1,825 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+// Headless benchmark for the move finder. Runs the game core over a fixed
+// corpus of seeds for each shipped board size and colour count, and reports
+// latency percentiles, throughput, heap allocations, peak RSS and finder counters.
+
+#include "AnalysisContext.h"
+#include "Board.h"
+#include "Connectivity.h"
+#include "Executor.h"
+#include "GameState.h"
+#include "MemoryProfile.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "MoveIndex.h"
+#include "MoveAnalysis.h"
+#include "SelectionBorder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sys/resource.h>
+#include <future>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+using namespace brac;
+
+// Heap allocations are counted by MemoryProfile, which the Makefile turns on, so that each series can report
+// allocations per call and the scopes can be broken down at the end, in the same figures a device build reports.
+static size_t allocations() { return MemoryProfile::total().allocations; }
+
+namespace {
+
+    typedef std::chrono::steady_clock Clock;
+
+    // How the corpus boards are colored: dot by dot at random, as the game does, or in random 2x2 blocks, which gives
+    // the big like-colored triple sets that make the triples engine quadratic.
+    enum class Layout { random, blocks };
+
+    struct Config {
+        size_t width, height, nColors;
+        Layout layout;
+    };
+
+    std::string layoutName(Layout l) {
+        return l == Layout::blocks ? "blocks" : "random";
+    }
+
+    Board blockBoard(Config const & config, size_t seed) {
+        std::mt19937 gen(seed);
+        std::uniform_int_distribution<> dist(0, config.nColors - 1);
+        int blocks[8][8];
+        for (auto & row : blocks)
+            for (auto & b : row)
+                b = dist(gen);
+
+        Board board(config.nColors);
+        for (size_t y = 0; y < config.height; ++y)
+            for (size_t x = 0; x < config.width; ++x)
+                board.colors[blocks[y / 2][x / 2]].set(x, y);
+        return board;
+    }
+
+    // Latencies (in µs) of every call to one function under one config.
+    struct Series {
+        std::string name;
+        std::vector<double> us;
+        size_t boards = 0, allocs = 0, probes = 0;
+        size_t peakRSS = 0;     // Bytes, as of the series' last measured call.
+        bool measured = false;
+
+        explicit Series(std::string name) : name(name) { }
+
+        double percentile(double p) const {
+            if (us.empty()) return 0;
+            std::vector<double> sorted(us);
+            std::sort(begin(sorted), end(sorted));
+            return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+        }
+
+        double total() const { return std::accumulate(begin(us), end(us), 0.0); }
+    };
+
+    struct Result {
+        Config config;
+        std::deque<Series> series;      // References stay valid as series are added.
+        Board::Stats stats{0, 0, 0, 0};
+        size_t seeds = 0, pairs = 0, shapes = 0;
+        size_t checksum = 0;
+        size_t mismatches = 0;
+
+        // Series are reported in the order they were first used.
+        Series & operator[](std::string const & name) {
+            for (auto & s : series)
+                if (s.name == name)
+                    return s;
+            series.emplace_back(name);
+            return series.back();
+        }
+
+        // Mean time per analysis in the first finder's calls. Stats are kept for one call per seed.
+        double nsPerAnalysis() const {
+            for (auto const & s : series)
+                if (s.name == "findMatchingPairs" && s.boards && stats.analyses)
+                    return s.total() * 1e3 / s.boards * seeds / stats.analyses;
+            return 0;
+        }
+    };
+
+    struct Options {
+        std::vector<Config> configs;
+        size_t nSeeds = 16;
+        size_t firstSeed = 0x5eed0000;
+        size_t repeat = 1;
+        size_t maxOtherMatches = 32;
+        size_t turns = 24;
+        std::vector<size_t> threads{1};
+        std::vector<Board::Engine> engines{Board::Engine::adaptive};
+        double budget = 60;     // Seconds per config; always runs at least one seed.
+        std::string json, memoryProfile, metrics, trace;
+    };
+
+    std::string engineName(Board::Engine e) {
+        switch (e) {
+            case Board::Engine::sweep   : return "sweep";
+            case Board::Engine::adaptive: return "adaptive";
+            default                     : return "triples";
+        }
+    }
+
+    template <typename F>
+    double time(F f) {
+        auto t0 = Clock::now();
+        f();
+        return std::chrono::duration<double, std::micro>(Clock::now() - t0).count();
+    }
+
+    // The process's peak resident set so far, in bytes.
+    size_t peakRSS() {
+        rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+        return ru.ru_maxrss;
+#else
+        return ru.ru_maxrss * size_t(1024);
+#endif
+    }
+
+    // Time one call to f, charging its heap allocations to s.
+    template <typename F>
+    void measure(Series & s, F f) {
+        size_t before = allocations();
+        double us = time(f);
+        s.allocs += allocations() - before;
+        s.us.push_back(us);
+        s.peakRSS = peakRSS();
+        s.measured = true;
+    }
+
+    // Time probes of a set holding some pairs: every pair, then each first shape paired with a neighbour's second.
+    template <typename Set>
+    void probe(Series & s, std::vector<std::array<BitBoard, 2>> const & ordered) {
+        Set set(begin(ordered), end(ordered));
+        size_t found = 0;
+        measure(s, [&]{
+            for (size_t j = 0; j < ordered.size(); ++j) {
+                auto const & p = ordered[j], & q = ordered[(j + 1) % ordered.size()];
+                found += set.count(p) + set.count(std::array<BitBoard, 2>{{p[0], q[1]}});
+            }
+        });
+        s.probes += 2 * ordered.size();
+        if (found < ordered.size())
+            std::cerr << s.name << " lost pairs\n";
+    }
+
+    // Order-independent digest of a result set, so that a faster finder can
+    // be checked against a slower one without comparing the sets directly.
+    size_t checksum(Board::Pairs const & pairs) {
+        size_t sum = 0;
+        for (auto const & p : pairs)
+            sum += hashWords({p[0].a, p[0].b, p[0].c, p[0].d, p[1].a, p[1].b, p[1].c, p[1].d});
+        return sum;
+    }
+
+    // True iff a and b are the same border triangles in the same order, allowing either winding for each.
+    bool sameTriangles(std::vector<SelectionBorder::Vertex> const & a, std::vector<SelectionBorder::Vertex> const & b) {
+        auto same = [](SelectionBorder::Vertex const & u, SelectionBorder::Vertex const & v) {
+            return u.position == v.position && u.texcoord == v.texcoord;
+        };
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); i += 3)
+            if (!same(a[i], b[i]) ||
+                !((same(a[i + 1], b[i + 1]) && same(a[i + 2], b[i + 2])) ||
+                  (same(a[i + 1], b[i + 2]) && same(a[i + 2], b[i + 1]))))
+                return false;
+        return true;
+    }
+
+    // The order possibleMoves() has always returned groups in: lexicographically by score lists, then by shape.
+    bool byScoreLists(std::shared_ptr<ShapeMatches> const & a, std::shared_ptr<ShapeMatches> const & b) {
+        auto comp = [](Match const & a, Match const & b) { return a.score > b.score; };
+
+        return (std::lexicographical_compare(begin(a->matches), end(a->matches), begin(b->matches), end(b->matches), comp) ||
+                (!std::lexicographical_compare(begin(b->matches), end(b->matches), begin(a->matches), end(a->matches), comp) &&
+                 a->shape > b->shape));
+    }
+
+    // The reference canonical form: the least of a shape's four orientations, moved to the origin.
+    BitBoard leastOrientation(BitBoard const & bb) {
+        auto least = bb.shiftWS(bb.marginW(), bb.marginS());
+        for (auto r : {bb.rotL(), bb.reverse(), bb.rotR()})
+            least = std::min(least, r.shiftWS(r.marginW(), r.marginS()));
+        return least;
+    }
+
+    // Wait for one background analysis, returning its result.
+    struct Waiter {
+        std::promise<std::shared_ptr<MoveAnalysis::Result>> promise;
+
+        MoveAnalysis::Done done() { return [this](std::shared_ptr<MoveAnalysis::Result> const & r) { promise.set_value(r); }; }
+        std::shared_ptr<MoveAnalysis::Result> wait() { return promise.get_future().get(); }
+    };
+
+    // Analyse board as the app does when a game starts, with its shard count, and time how soon the table would show
+    // rows: from start() to the first batch of groups taken on the main thread, and to each batch after it. A
+    // condition variable stands in for the main queue. The batches must hold the whole result, in order.
+    void analyseToRows(Result & result, Board const & board, size_t seed) {
+        auto & firstRow = result["analysis/first row"], & rowBatches = result["analysis/row batches"];
+        std::mutex mutex;
+        std::condition_variable wake;
+        size_t scheduled = 0;
+        std::shared_ptr<MoveAnalysis::Result> done;
+        auto batches = std::make_shared<MoveAnalysis::Batches>([&](std::shared_ptr<MoveAnalysis::Batches> const &) {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++scheduled;
+            wake.notify_one();
+        });
+
+        MoveAnalysis analysis;
+        GameState::ShapeMatcheses rows;
+        auto t0 = Clock::now();
+        analysis.start(board, MoveIndex(), Executor::shared().nThreads(), [&](std::shared_ptr<MoveAnalysis::Result> const & r) {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = r;
+            wake.notify_one();
+        }, [&](std::shared_ptr<ShapeMatches> const & g) { batches->add(g); });
+
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [&]{ return scheduled || done; });
+            if (!scheduled)
+                break;
+            --scheduled;
+            auto groups = batches->take();
+            auto us = std::chrono::duration<double, std::micro>(Clock::now() - t0).count();
+            if (rows.empty())
+                firstRow.us.push_back(us);
+            rowBatches.us.push_back(us);
+            rows.insert(end(rows), begin(groups), end(groups));
+        }
+        if (rows != done->matcheses) {
+            std::cerr << "Seed " << std::hex << seed << std::dec << ": analysis batched " << rows.size() << " groups; expected "
+                      << done->matcheses.size() << "\n";
+            ++result.mismatches;
+        }
+    }
+
+    // Start a full analysis of each board in turn without waiting, as rapid matches would. Each supersedes the one
+    // before, so only the last should finish, about one analysis after it started, and the burst should cost about
+    // as much CPU as that analysis on its own.
+    void analyseBurst(Result & result, std::vector<Board> const & boards, Options const & opts) {
+        auto & single = result["analysis/single"], & singleCPU = result["analysis/single cpu"];
+        auto & burst = result["analysis/burst"], & burstCPU = result["analysis/burst cpu"];
+        MoveAnalysis analysis;
+
+        auto cpu = []{ return 1e6 * std::clock() / CLOCKS_PER_SEC; };
+        {
+            Waiter w;
+            double c0 = cpu();
+            measure(single, [&]{
+                analysis.start(boards.back(), MoveIndex(), opts.threads[0], w.done());
+                w.wait();
+            });
+            singleCPU.us.push_back(cpu() - c0);
+        }
+
+        std::atomic<size_t> superseded{0};
+        Waiter w;
+        double c0 = cpu();
+        for (size_t i = 0; i + 1 < boards.size(); ++i)
+            analysis.start(boards[i], MoveIndex(), opts.threads[0], [&](std::shared_ptr<MoveAnalysis::Result> const &) { ++superseded; });
+        std::shared_ptr<MoveAnalysis::Result> last;
+        measure(burst, [&]{
+            analysis.start(boards.back(), MoveIndex(), opts.threads[0], w.done());
+            last = w.wait();
+        });
+        burstCPU.us.push_back(cpu() - c0);
+
+        if (last->moves.pairs() != boards.back().findMatchingPairs(nullptr, opts.threads[0], opts.engines[0])) {
+            std::cerr << "Analysis of the last board in a burst disagrees with a full search\n";
+            ++result.mismatches;
+        }
+        if (superseded)
+            std::cerr << superseded << " of " << boards.size() - 1 << " superseded analyses finished anyway\n";
+    }
+
+    Result run(Config const & config, Options const & opts) {
+        Result result;
+        result.config = config;
+
+        auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(opts.budget));
+        AnalysisContext ctx;
+        for (size_t i = 0; i < opts.nSeeds && (i == 0 || Clock::now() < deadline); ++i) {
+            size_t seed = opts.firstSeed + i;
+            ++result.seeds;
+            GameState game(config.nColors, config.width, config.height, &seed);
+            Board const board = config.layout == Layout::blocks ? blockBoard(config, seed) : game.board();
+
+            Board::Pairs pairs;
+            Board::Stats stats;
+            auto & findMatchingPairs = result["findMatchingPairs"];
+            for (size_t r = 0; r < opts.repeat; ++r) {
+                measure(findMatchingPairs, [&]{ pairs = board.findMatchingPairs(&stats, opts.threads[0], opts.engines[0]); });
+                ++findMatchingPairs.boards;
+            }
+
+            // Other engines and thread counts must agree exactly with the first.
+            for (auto e : opts.engines)
+                for (auto t : opts.threads) {
+                    if (e == opts.engines[0] && t == opts.threads[0])
+                        continue;
+                    std::string name = "findMatchingPairs";
+                    if (e != opts.engines[0])
+                        name += "/" + engineName(e);
+                    if (t != opts.threads[0])
+                        name += "/" + std::to_string(t) + "t";
+
+                    Board::Pairs other;
+                    auto & series = result[name];
+                    for (size_t r = 0; r < opts.repeat; ++r) {
+                        measure(series, [&]{ other = board.findMatchingPairs(nullptr, t, e); });
+                        ++series.boards;
+                    }
+                    if (other != pairs) {
+                        std::cerr << "Seed " << std::hex << seed << std::dec << ": " << name << " found " << other.size()
+                                  << " pairs; expected " << pairs.size() << "\n";
+                        ++result.mismatches;
+                    }
+                }
+
+            // So must the generic kernels, which every color count falls back to.
+            {
+                Board::Pairs generic;
+                auto & series = result["findMatchingPairs/generic"];
+                for (size_t r = 0; r < opts.repeat; ++r) {
+                    // A fresh context each time, as the series it is compared with has.
+                    measure(series, [&]{
+                        AnalysisContext ctx;
+                        ctx.colorLoops = Board::ColorLoops::generic;
+                        board.findMatchingPairs(ctx, nullptr, opts.threads[0], opts.engines[0]);
+                        generic = std::move(ctx.pairs);
+                    });
+                    ++series.boards;
+                }
+                if (generic != pairs) {
+                    std::cerr << "Seed " << std::hex << seed << std::dec << ": findMatchingPairs/generic found "
+                              << generic.size() << " pairs; expected " << pairs.size() << "\n";
+                    ++result.mismatches;
+                }
+            }
+
+            // The same search through one context, shared by every board. Once it has warmed up on a board, searching
+            // that board again should allocate nothing.
+            {
+                auto & series = result["findMatchingPairs/context"];
+                board.findMatchingPairs(ctx, nullptr, opts.threads[0], opts.engines[0]);
+                for (size_t r = 0; r < opts.repeat; ++r) {
+                    measure(series, [&]{ board.findMatchingPairs(ctx, nullptr, opts.threads[0], opts.engines[0]); });
+                    ++series.boards;
+                }
+                if (ctx.pairs != pairs) {
+                    std::cerr << "Seed " << std::hex << seed << std::dec << ": findMatchingPairs/context found "
+                              << ctx.pairs.size() << " pairs; expected " << pairs.size() << "\n";
+                    ++result.mismatches;
+                }
+            }
+
+            result.stats.analyses += stats.analyses;
+            result.stats.tests    += stats.tests;
+            result.stats.matches  += stats.matches;
+            result.stats.overlaps += stats.overlaps;
+            result.pairs += pairs.size();
+            result.checksum += checksum(pairs);
+
+            // Streamed groups must arrive in the order of the final list, which must be sorted as it always was.
+            GameState::ShapeMatcheses matcheses, streamed;
+            auto & possibleMoves = result["possibleMoves"], & firstGroup = result["possibleMoves/first group"];
+            for (size_t r = 0; r < opts.repeat; ++r) {
+                streamed.clear();
+                auto t0 = Clock::now();
+                measure(possibleMoves, [&]{
+                    matcheses = GameState::possibleMoves(board, opts.threads[0], opts.engines[0], [&](std::shared_ptr<ShapeMatches> const & g) {
+                        if (streamed.empty())
+                            firstGroup.us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+                        streamed.push_back(g);
+                    });
+                });
+                ++possibleMoves.boards;
+            }
+            result.shapes += matcheses.size();
+            if (streamed != matcheses || !std::is_sorted(begin(matcheses), end(matcheses), byScoreLists)) {
+                std::cerr << "Seed " << std::hex << seed << std::dec << ": possibleMoves streamed or sorted groups out of order\n";
+                ++result.mismatches;
+            }
+            streamed.clear();
+            analyseToRows(result, board, seed);
+
+            // And through the context, whose groups must be the same shapes with the same matches.
+            {
+                auto & series = result["possibleMoves/context"];
+                GameState::possibleMoves(ctx, board, opts.threads[0], opts.engines[0]);
+                for (size_t r = 0; r < opts.repeat; ++r) {
+                    measure(series, [&]{ GameState::possibleMoves(ctx, board, opts.threads[0], opts.engines[0]); });
+                    ++series.boards;
+                }
+                bool same = ctx.matcheses.size() == matcheses.size();
+                for (size_t i = 0; same && i < matcheses.size(); ++i) {
+                    auto const & a = *ctx.matcheses[i], & b = *matcheses[i];
+                    same = a.shape == b.shape && a.matches.size() == b.matches.size();
+                }
+                if (!same) {
+                    std::cerr << "Seed " << std::hex << seed << std::dec << ": possibleMoves/context grouped differently\n";
+                    ++result.mismatches;
+                }
+            }
+
+            // Grouping alone, from pairs already found. Every match must land under the least orientation of its
+            // shape, however canonicalise() breaks ties.
+            auto & grouping = result["possibleMoves/grouping"];
+            for (size_t r = 0; r < opts.repeat; ++r) {
+                measure(grouping, [&]{ matcheses = GameState::possibleMoves(pairs); });
+                ++grouping.boards;
+            }
+            for (auto const & sm : matcheses)
+                for (auto const & m : sm->matches) {
+                    auto c = GameState::canonicalise(m.shape1);
+                    if (c.bb != leastOrientation(m.shape1) || c.bb != sm->shape || c.sr * m.shape1 != c.bb) {
+                        std::cerr << "Seed " << std::hex << seed << std::dec << ": possibleMoves misgrouped a match\n";
+                        ++result.mismatches;
+                    }
+                }
+
+            // Time matching pairs and, as the common negative case, each
+            // pair's first shape against the next pair's second shape.
+            Board const prerotated[4] = {board, board.rotL(), board.reverse(), board.rotR()};
+            std::vector<std::array<BitBoard, 2>> ordered(begin(pairs), end(pairs));
+            std::sort(begin(ordered), end(ordered), [](std::array<BitBoard, 2> const & a, std::array<BitBoard, 2> const & b) {
+                return a[0] < b[0] || (!(b[0] < a[0]) && a[1] < b[1]);
+            });
+            // The vector kernel must agree with the scalar one, with and without a fixed color count.
+            auto & selectionsMatch = result[std::string("selectionsMatch/") + Board::selectionsMatchKernel()];
+            auto & selectionsMatchGeneric = result[std::string("selectionsMatch/") + Board::selectionsMatchKernel() + "/generic"];
+            auto & selectionsMatchScalar = result["selectionsMatch/scalar*"];
+            volatile bool sink = false;
+            for (size_t j = 0; j < ordered.size(); ++j) {
+                auto const & p = ordered[j];
+                auto const & q = ordered[(j + 1) % ordered.size()];
+                for (auto const & b : {p[1], q[1]}) {
+                    bool match, generic, expected;
+                    selectionsMatch.us.push_back(time([&]{ sink = match = Board::selectionsMatch(prerotated, p[0], b); }));
+                    selectionsMatchGeneric.us.push_back(time([&]{
+                        sink = generic = Board::selectionsMatch(prerotated, p[0], b, Board::ColorLoops::generic);
+                    }));
+                    selectionsMatchScalar.us.push_back(time([&]{ sink = expected = Board::selectionsMatchScalar(prerotated, p[0], b); }));
+                    if (match != expected || generic != expected) {
+                        std::cerr << "Seed " << std::hex << seed << std::dec << ": " << Board::selectionsMatchKernel()
+                                  << " selectionsMatch disagrees with scalar\n";
+                        ++result.mismatches;
+                    }
+                }
+            }
+
+            if (!ordered.empty()) {
+                probe<std::unordered_set<std::array<BitBoard, 2>>>(result["probe/unordered_set"], ordered);
+                probe<Board::Pairs>(result["probe/FlatHashSet"], ordered);
+            }
+
+            auto & findOtherMatches = result["findOtherMatches"], & findOtherMatchesGeneric = result["findOtherMatches/generic"];
+            for (size_t j = 0; j < std::min(ordered.size(), opts.maxOtherMatches); ++j) {
+                std::vector<BitBoard> sels{ordered[j][0], ordered[j][1]}, others, generic;
+                findOtherMatches.us.push_back(time([&]{ others = board.findOtherMatches(sels); }));
+                findOtherMatchesGeneric.us.push_back(time([&]{ generic = board.findOtherMatches(sels, Board::ColorLoops::generic); }));
+                if (others != generic) {
+                    std::cerr << "Seed " << std::hex << seed << std::dec << ": findOtherMatches/generic disagrees\n";
+                    ++result.mismatches;
+                }
+            }
+            (void)sink;
+
+            // Mesh selection borders: shapes that are moves, then big selections (a color each, and the whole board).
+            // The table-driven mesher must make the reference's triangles.
+            {
+                std::vector<BitBoard> shapes, large;
+                for (size_t j = 0; j < std::min(ordered.size(), opts.maxOtherMatches); ++j)
+                    shapes.push_back(ordered[j][0]);
+                for (size_t c = 0; c < board.nColors(); ++c)
+                    large.push_back(board.colors[c]);
+                large.push_back(board.computeMask());
+                std::vector<SelectionBorder::Vertex> lut, reference;
+                for (auto const * bbs : {&shapes, &large}) {
+                    auto suffix = bbs == &large ? "/large" : "";
+                    auto & lutSeries = result[std::string("selectionBorder/lut") + suffix];
+                    auto & referenceSeries = result[std::string("selectionBorder/reference*") + suffix];
+                    for (auto const & bb : *bbs) {
+                        measure(lutSeries, [&]{ SelectionBorder::mesh(bb, lut); });
+                        measure(referenceSeries, [&]{ SelectionBorder::meshReference(bb, int(config.width), int(config.height), reference); });
+                        if (!sameTriangles(lut, reference)) {
+                            std::cerr << "Seed " << std::hex << seed << std::dec << ": selection border mesh disagrees with reference\n";
+                            ++result.mismatches;
+                        }
+                    }
+                }
+            }
+
+            // Connected regions: label each color's regions, then ask of each region (move shapes, color regions and
+            // whole color planes, which are in pieces) which cells it would split without. Bit-parallel dilation and
+            // cut cells must agree with brac::floodFill, one fill per region or per cell.
+            {
+                auto & labels = result["components/dilation"], & labelsReference = result["components/floodFill*"];
+                std::vector<BitBoard> regions, dilated, filled;
+                dilated.reserve(256);
+                filled.reserve(256);
+                for (size_t c = 0; c < board.nColors(); ++c) {
+                    dilated.clear();
+                    filled.clear();
+                    measure(labels, [&]{
+                        Connectivity::forEachComponent(board.colors[c], [&](BitBoard const & r) { dilated.push_back(r); });
+                    });
+                    measure(labelsReference, [&]{
+                        for (auto bb = board.colors[c]; bb;) {
+                            auto r = floodFill(bb.ls1b(), bb);
+                            bb &= ~r;
+                            filled.push_back(r);
+                        }
+                    });
+                    if (dilated != filled) {
+                        std::cerr << "Seed " << std::hex << seed << std::dec << ": regions of color " << c << " disagree\n";
+                        ++result.mismatches;
+                    }
+                    regions.push_back(board.colors[c]);
+                    for (auto const & r : filled)
+                        if (r.count() >= 3)
+                            regions.push_back(r);
+                }
+                for (size_t j = 0; j < std::min(ordered.size(), opts.maxOtherMatches); ++j)
+                    regions.push_back(ordered[j][0]);
+
+                auto & splits = result["splits/cutCells"], & splitsReference = result["splits/floodFill*"];
+                for (auto const & region : regions) {
+                    auto cuts = BitBoard::empty(), reference = BitBoard::empty();
+                    measure(splits, [&]{ cuts = Connectivity::cutCells(region); });
+                    measure(splitsReference, [&]{
+                        for (auto cells = region; cells;) {
+                            auto p = cells.ls1b();
+                            cells &= ~p;
+                            auto rest = region & ~p;
+                            if (floodFill(rest.ls1b(), rest) != rest)
+                                reference |= p;
+                        }
+                    });
+                    if (cuts != reference) {
+                        std::cerr << "Seed " << std::hex << seed << std::dec << ": cut cells disagree with flood fill\n";
+                        ++result.mismatches;
+                    }
+                }
+            }
+
+            // Play the biggest move, turn after turn, keeping an index of moves up to date. Every update is checked
+            // against a full search of the same board.
+            MoveIndex index;
+            index.engine = opts.engines[0];
+            index.reset(board, opts.threads[0]);
+            Board played = board;
+            std::vector<Board> burst{board};
+            auto & incremental = result["moves/incremental"], & full = result["moves/full"];
+            for (size_t turn = 0; turn < opts.turns && !index.pairs().empty(); ++turn) {
+                auto best = *std::max_element(begin(index.pairs()), end(index.pairs()),
+                                              [](std::array<BitBoard, 2> const & a, std::array<BitBoard, 2> const & b) {
+                                                  return a[0].count() < b[0].count() || (a[0].count() == b[0].count() && a < b);
+                                              });
+                auto cleared = best[0] | best[1];
+                played &= ~cleared;
+                burst.push_back(played);
+
+                measure(incremental, [&]{
+                    index.cleared(cleared);
+                    index.update(played, opts.threads[0]);
+                });
+                Board::Pairs all;
+                measure(full, [&]{ all = played.findMatchingPairs(nullptr, opts.threads[0], opts.engines[0]); });
+                if (all != index.pairs()) {
+                    std::cerr << "Seed " << std::hex << seed << std::dec << ", turn " << turn << ": ";
+                    index.verify();
+                    ++result.mismatches;
+                }
+            }
+
+            analyseBurst(result, burst, opts);
+        }
+
+        return result;
+    }
+
+    void print(std::ostream & os, Result const & r) {
+        auto const & c = r.config;
+        os << c.width << "x" << c.height << " " << c.nColors << " colors" << (c.layout == Layout::blocks ? " in blocks" : "")
+           << ", " << r.seeds << " seeds: "
+           << r.pairs << " pairs, " << r.shapes << " shapes, checksum " << std::hex << r.checksum << std::dec << "\n"
+           << "    " << r.stats.analyses << " analyses; " << r.stats.tests << " tests; "
+           << r.stats.matches << " matches; " << r.stats.overlaps << " overlaps; "
+           << std::fixed << std::setprecision(1) << r.nsPerAnalysis() << " ns/analysis\n";
+        for (auto const & s : r.series) {
+            os << "    " << std::left << std::setw(22) << s.name << std::right << std::fixed << std::setprecision(1)
+               << " n=" << std::setw(6) << s.us.size()
+               << "  p50=" << std::setw(9) << s.percentile(0.5)
+               << "  p90=" << std::setw(9) << s.percentile(0.9)
+               << "  p99=" << std::setw(9) << s.percentile(0.99)
+               << "  max=" << std::setw(9) << s.percentile(1) << " µs";
+            if (s.boards)
+                os << "  " << std::setprecision(1) << s.boards / (s.total() * 1e-6) << " boards/s";
+            if (s.measured)
+                os << "  " << std::setprecision(1) << double(s.allocs) / s.us.size() << " allocs/call"
+                   << "  " << std::setprecision(1) << s.peakRSS / 1048576.0 << " MB peak RSS";
+            if (s.probes)
+                os << "  " << std::setprecision(2) << s.total() * 1e3 / s.probes << " ns/probe";
+            os << "\n";
+        }
+    }
+
+    void writeJson(std::ostream & os, std::vector<Result> const & results) {
+        os << "{\n  \"results\": [";
+        for (auto const & r : results) {
+            auto const & c = r.config;
+            os << (&r == &results[0] ? "\n" : ",\n")
+               << "    {\"width\": " << c.width << ", \"height\": " << c.height << ", \"colors\": " << c.nColors << ", \"layout\": \"" << layoutName(c.layout) << "\""
+               << ", \"seeds\": " << r.seeds << ", \"pairs\": " << r.pairs << ", \"shapes\": " << r.shapes << ", \"checksum\": \"" << std::hex << r.checksum << std::dec << "\""
+               << ", \"mismatches\": " << r.mismatches << ", \"analyses\": " << r.stats.analyses << ", \"tests\": " << r.stats.tests
+               << ", \"matches\": " << r.stats.matches << ", \"overlaps\": " << r.stats.overlaps
+               << ", \"ns_per_analysis\": " << std::fixed << std::setprecision(3) << r.nsPerAnalysis()
+               << ", \"series\": {";
+            for (auto const & s : r.series) {
+                os << (&s == &r.series[0] ? "" : ", ") << std::fixed << std::setprecision(3)
+                   << "\"" << s.name << "\": {\"calls\": " << s.us.size()
+                   << ", \"p50_us\": " << s.percentile(0.5) << ", \"p90_us\": " << s.percentile(0.9)
+                   << ", \"p99_us\": " << s.percentile(0.99) << ", \"max_us\": " << s.percentile(1)
+                   << ", \"total_us\": " << s.total();
+                if (s.boards)
+                    os << ", \"boards_per_sec\": " << s.boards / (s.total() * 1e-6);
+                if (s.measured)
+                    os << ", \"allocs_per_call\": " << double(s.allocs) / s.us.size() << ", \"peak_rss\": " << s.peakRSS;
+                if (s.probes)
+                    os << ", \"ns_per_probe\": " << s.total() * 1e3 / s.probes;
+                os << "}";
+            }
+            os << "}}";
+        }
+        os << "\n  ]\n}\n";
+    }
+
+    void usage(char const * argv0) {
+        std::cerr << "usage: " << argv0 << " [--seeds N] [--first-seed HEX] [--repeat N] [--size WxH]... [--colors LO-HI] [--threads N,...] [--engines E,...] [--layouts L,...] [--turns N] [--budget SECS] [--json FILE] [--memory-profile FILE] [--metrics FILE] [--trace FILE]\n";
+        std::exit(2);
+    }
+
+}
+
+int main(int argc, char * argv[]) {
+    Options opts;
+    std::vector<std::pair<size_t, size_t>> sizes;
+    size_t loColors = 2, hiColors = 5;
+    std::vector<Layout> layouts{Layout::random, Layout::blocks};
+
+    for (int i = 1; i < argc; ++i) {
+        auto arg = [&]{ if (++i == argc) usage(argv[0]); return argv[i]; };
+        if (!std::strcmp(argv[i], "--seeds")) {
+            opts.nSeeds = std::strtoul(arg(), nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--first-seed")) {
+            opts.firstSeed = std::strtoul(arg(), nullptr, 16);
+        } else if (!std::strcmp(argv[i], "--repeat")) {
+            opts.repeat = std::max(1UL, std::strtoul(arg(), nullptr, 10));
+        } else if (!std::strcmp(argv[i], "--size")) {
+            size_t w, h;
+            if (std::sscanf(arg(), "%zux%zu", &w, &h) != 2 || !w || !h || w > 16 || h > 16) usage(argv[0]);
+            sizes.emplace_back(w, h);
+        } else if (!std::strcmp(argv[i], "--colors")) {
+            if (std::sscanf(arg(), "%zu-%zu", &loColors, &hiColors) == 1) hiColors = loColors;
+            if (loColors < 2 || hiColors > Board::maxColors || loColors > hiColors) usage(argv[0]);
+        } else if (!std::strcmp(argv[i], "--threads")) {
+            opts.threads.clear();
+            for (char * p = arg(); *p;) {
+                opts.threads.push_back(std::max(1UL, std::strtoul(p, &p, 10)));
+                if (*p && *p++ != ',') usage(argv[0]);
+            }
+        } else if (!std::strcmp(argv[i], "--engines")) {
+            opts.engines.clear();
+            std::string list = arg();
+            for (size_t b = 0, e; b <= list.size(); b = e + 1) {
+                e = std::min(list.find(',', b), list.size());
+                auto name = list.substr(b, e - b);
+                if      (name == "triples" ) opts.engines.push_back(Board::Engine::triples );
+                else if (name == "sweep"   ) opts.engines.push_back(Board::Engine::sweep   );
+                else if (name == "adaptive") opts.engines.push_back(Board::Engine::adaptive);
+                else usage(argv[0]);
+            }
+        } else if (!std::strcmp(argv[i], "--layouts")) {
+            layouts.clear();
+            std::string list = arg();
+            for (size_t b = 0, e; b <= list.size(); b = e + 1) {
+                e = std::min(list.find(',', b), list.size());
+                auto name = list.substr(b, e - b);
+                if      (name == "random") layouts.push_back(Layout::random);
+                else if (name == "blocks") layouts.push_back(Layout::blocks);
+                else usage(argv[0]);
+            }
+        } else if (!std::strcmp(argv[i], "--turns")) {
+            opts.turns = std::strtoul(arg(), nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--budget")) {
+            opts.budget = std::strtod(arg(), nullptr);
+        } else if (!std::strcmp(argv[i], "--json")) {
+            opts.json = arg();
+        } else if (!std::strcmp(argv[i], "--memory-profile")) {
+            opts.memoryProfile = arg();
+        } else if (!std::strcmp(argv[i], "--metrics")) {
+            opts.metrics = arg();
+        } else if (!std::strcmp(argv[i], "--trace")) {
+            opts.trace = arg();
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    // The board sizes the app ships: iPhone and iPad.
+    if (sizes.empty())
+        sizes = {{12, 8}, {16, 16}};
+
+    // Blocky boards are the hard case: their uniform regions overlap their own images under small shifts. The engines
+    // emit only the maximal pairs in such a region, but on a 16x16 board in two colors those alone run to hundreds of
+    // thousands per region, so that one config is left out; --budget bounds the time spent on the rest.
+    for (auto l : layouts)
+        for (auto const & s : sizes)
+            for (size_t n = loColors; n <= hiColors; ++n)
+                if (l == Layout::random || n >= 3 || s.first * s.second <= 12 * 8)
+                    opts.configs.push_back(Config{s.first, s.second, n, l});
+
+    std::vector<Result> results;
+    size_t mismatches = 0;
+    MemoryProfile::reset();
+    Metrics::reset();
+    if (!opts.trace.empty())
+        Trace::start();
+    for (auto const & c : opts.configs) {
+        results.push_back(run(c, opts));
+        print(std::cout, results.back());
+        mismatches += results.back().mismatches;
+    }
+
+    // Where the memory went, over the whole run.
+    std::cout << "Memory by scope:\n";
+    for (auto const & s : MemoryProfile::scopes())
+        if (s.allocations)
+            std::cout << "    " << std::left << std::setw(46) << s.name << std::right
+                      << std::setw(10) << s.allocations << " allocs " << std::setw(12) << s.bytes << " bytes "
+                      << std::setw(10) << s.peak << " peak live\n";
+    if (!opts.memoryProfile.empty() && !MemoryProfile::dump(opts.memoryProfile.c_str())) {
+        std::cerr << "Failed to write " << opts.memoryProfile << "\n";
+        return 1;
+    }
+
+    // What the core's counters and timers saw, over the whole run. Timers are in ns.
+    std::cout << "Metrics:\n";
+    for (auto const & c : Metrics::counters())
+        std::cout << "    " << std::left << std::setw(46) << c.name << std::right << std::setw(14) << c.value << "\n";
+    for (auto const & h : Metrics::histograms())
+        std::cout << "    " << std::left << std::setw(46) << h.name << std::right
+                  << std::setw(10) << h.count << " values " << std::setw(14) << std::fixed << std::setprecision(1) << h.mean()
+                  << " mean " << std::setw(12) << h.max << " max\n";
+    if (!opts.metrics.empty() && !Metrics::dump(opts.metrics.c_str())) {
+        std::cerr << "Failed to write " << opts.metrics << "\n";
+        return 1;
+    }
+
+    if (!opts.trace.empty()) {
+        Trace::stop();
+        if (!Trace::write(opts.trace.c_str())) {
+            std::cerr << "Failed to write " << opts.trace << "\n";
+            return 1;
+        }
+    }
+
+    if (!opts.json.empty()) {
+        std::ofstream os(opts.json);
+        writeJson(os, results);
+        if (!os) {
+            std::cerr << "Failed to write " << opts.json << "\n";
+            return 1;
+        }
+    }
+
+    return mismatches ? 1 : 0;
+}
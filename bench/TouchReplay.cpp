@@ -0,0 +1,462 @@
+//  Copyright © 2013 Marcelo Cantos <me@marcelocantos.com>
+
+// Headless touch benchmark. Replays touch traces into the game core and reports how long each kind of input took to
+// handle, with a digest of the final state so that a change to the selection logic that alters behaviour shows up.
+// Given trace files, it replays those; otherwise it plays a fixed corpus of games itself, dragging out the biggest move
+// with two fingers turn after turn, records them, and checks that replaying the saved traces ends in the same state
+// and that the game finds every step of each drag feasible, and dims selections drawn before the moves were known
+// once they are.
+// It also plays a many-finger stress game, in which a crowd of fingers keeps making short selections until the board
+// holds as many as it can, to load the selection bookkeeping rather than the matcher. Each stress game is replayed a
+// second time while the game's board is analysed over and over in the background, as the app analyses it while the
+// player plays, to show how much that slows the handling of touches on the main thread.
+
+#include "Executor.h"
+#include "GameState.h"
+#include "MoveAnalysis.h"
+#include "MoveIndex.h"
+#include "TouchTrace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace brac;
+
+namespace {
+
+    struct Options {
+        size_t nSeeds = 8;
+        size_t firstSeed = 0x5eed0000;
+        size_t nColors = 4;
+        size_t turns = 12;
+        size_t fingers = 10, rounds = 200;
+        std::vector<std::pair<size_t, size_t>> sizes;
+        bool realTime = false;
+        std::string save;
+        std::vector<std::string> traces;
+    };
+
+    // Full analyses of one board, run one after another as the app runs them, with its shard count and at its priority,
+    // from construction until destruction.
+    class AnalysisLoad {
+    public:
+        explicit AnalysisLoad(Board const & board) : thread_([=]{
+            while (!stopping_) {
+                std::promise<void> done;
+                analysis_.start(board, MoveIndex(), Executor::shared().nThreads(),
+                                [&](std::shared_ptr<MoveAnalysis::Result> const &) { done.set_value(); });
+                done.get_future().wait();
+                ++analyses_;
+            }
+        }) { }
+
+        ~AnalysisLoad() {
+            stopping_ = true;
+            thread_.join();
+        }
+
+        size_t analyses() const { return analyses_; }
+
+    private:
+        std::atomic<bool> stopping_{false};
+        std::atomic<size_t> analyses_{0};
+        MoveAnalysis analysis_;
+        std::thread thread_;    // Last, so that it starts once the rest is ready.
+    };
+
+    // The cells of a connected shape in an order a finger can drag them: each next to one before it.
+    std::vector<vec2> dragPath(BitBoard const & shape) {
+        std::vector<vec2> path;
+        auto reached = shape.ls1b();
+        for (auto frontier = reached; frontier; frontier = reached.nhood4() & shape & ~reached, reached |= frontier)
+            for (int y = 0; y < 16; ++y)
+                for (int x = 0; x < 16; ++x)
+                    if (frontier.isSet(x, y))
+                        path.push_back(vec2{static_cast<float>(x), static_cast<float>(y)});
+        return path;
+    }
+
+    // Feasibility answers in played games that left out the move being dragged or disagreed with the move index.
+    size_t infeasible = 0;
+
+    // Check what the game says about a part of one half of a move: the move must be among its completions, each
+    // carrying the part onto the other half, and there must be one per half of a move that holds it.
+    void checkFeasibility(GameState & game, BitBoard const & cells, BitBoard const & half, BitBoard const & other, size_t seed) {
+        size_t holders = 0;
+        for (auto const & p : game.moves().pairs())
+            holders += !(cells & ~p[0]) + !(cells & ~p[1]);
+
+        auto const & f = game.feasibility(cells);
+        bool found = false, consistent = f.known && f.cells == cells && f.completions.size() == holders;
+        for (auto const & c : f.completions) {
+            consistent = consistent && !(cells & ~c.half) && c.transform * c.half == c.other &&
+                         c.counterpart == c.transform * cells && !(c.counterpart & ~c.other);
+            found = found || (c.half == half && c.other == other);
+        }
+        if (!found || !consistent) {
+            std::cerr << "Seed " << std::hex << seed << std::dec << ": feasibility of a dragged move "
+                      << (found ? "disagrees with the move index" : "leaves the move out") << "\n";
+            ++infeasible;
+        }
+    }
+
+    // Selections whose dimming was left stale when new moves landed.
+    size_t misdimmed = 0;
+
+    // Draw selections before the game has moves, as happens between a match and the analysis that follows it, then
+    // hand it the moves. Borders kept by onSelectionChanged, as the renderer keeps them, must end up dimmed just where
+    // no move holds the selection: here, the start of the biggest move's first half, and a few straight runs of three
+    // that no move holds.
+    void checkReassessment(size_t seed, size_t width, size_t height, Options const & opts) {
+        GameState game(opts.nColors, width, height, &seed);
+        MoveIndex index;
+        index.reset(game.board());
+        if (index.pairs().empty())
+            return;
+
+        std::vector<int> dim(GameState::Selections::capacity, -1);
+        game.onSelectionChanged.connect([&](GameState::SelectionChanges const & changes) {
+            for (auto const & c : changes)
+                dim[c.index] = c.kind == GameState::SelectionChange::removed ? -1 : game.hopeless(game.sels().at(c.index).is_selected);
+        });
+
+        auto const & pairs = index.pairs();
+        auto best = *std::max_element(begin(pairs), end(pairs), [](std::array<BitBoard, 2> const & a, std::array<BitBoard, 2> const & b) {
+            return a[0].count() < b[0].count() || (a[0].count() == b[0].count() && a < b);
+        });
+        auto held = [&](BitBoard const & cells) {
+            return std::any_of(begin(pairs), end(pairs), [&](std::array<BitBoard, 2> const & p) {
+                return !(cells & ~p[0]) || !(cells & ~p[1]);
+            });
+        };
+
+        std::vector<std::vector<vec2>> paths{dragPath(best[0])};
+        paths[0].resize(GameState::minimumSelection);
+        auto taken = best[0];
+        for (int y = 0; y < int(height) && paths.size() < 4; ++y)
+            for (int x = 0; x + 2 < int(width) && paths.size() < 4; ++x) {
+                auto run = BitBoard::single(x, y) | BitBoard::single(x + 1, y) | BitBoard::single(x + 2, y);
+                if (!(run & taken.nhood4()) && !held(run)) {
+                    paths.push_back({vec2{float(x), float(y)}, vec2{float(x + 1), float(y)}, vec2{float(x + 2), float(y)}});
+                    taken |= run;
+                }
+            }
+
+        char finger;
+        for (auto const & path : paths) {
+            game.touchesBegan({GameState::Touch{&finger, path[0], false}});
+            for (auto const & p : path)
+                game.touchesMoved({GameState::Touch{&finger, p, true}});
+            game.touchesEnded({GameState::Touch{&finger, path.back(), true}});
+        }
+        game.setMoves(index);
+
+        for (auto const & sel : game.sels()) {
+            bool h = held(sel.second.is_selected);
+            if (dim[sel.first] != !h) {
+                std::cerr << "Seed " << std::hex << seed << std::dec << ": a selection drawn before the moves were known is "
+                          << (h ? "dimmed" : "not dimmed") << " after they are\n";
+                ++misdimmed;
+            }
+        }
+    }
+
+    // Play one game: each turn, drag out both halves of the biggest move at once, then match them. Each step of the
+    // drag is checked for feasibility.
+    TouchTrace play(size_t seed, size_t width, size_t height, Options const & opts, size_t & stateHash) {
+        GameState game(opts.nColors, width, height, &seed);
+        TouchRecorder recorder(game);
+        MoveIndex index;
+        index.reset(game.board());
+        game.setMoves(index);
+
+        char fingers[2];
+        for (size_t turn = 0; turn < opts.turns && !game.moves().pairs().empty(); ++turn) {
+            auto const & pairs = game.moves().pairs();
+            auto best = *std::max_element(begin(pairs), end(pairs), [](std::array<BitBoard, 2> const & a, std::array<BitBoard, 2> const & b) {
+                return a[0].count() < b[0].count() || (a[0].count() == b[0].count() && a < b);
+            });
+            std::vector<vec2> paths[2] = {dragPath(best[0]), dragPath(best[1])};
+            BitBoard drawn[2] = {BitBoard::empty(), BitBoard::empty()};
+
+            std::vector<GameState::Touch> touches;
+            for (int f = 0; f < 2; ++f)
+                touches.push_back(GameState::Touch{&fingers[f], paths[f][0], false});
+            game.touchesBegan(touches);
+            for (size_t step = 0; step < std::max(paths[0].size(), paths[1].size()); ++step) {
+                touches.clear();
+                for (int f = 0; f < 2; ++f)
+                    if (step < paths[f].size())
+                        touches.push_back(GameState::Touch{&fingers[f], paths[f][step], true});
+                game.touchesMoved(touches);
+                for (int f = 0; f < 2; ++f)
+                    if (step < paths[f].size()) {
+                        drawn[f] |= BitBoard::single(paths[f][step]);
+                        checkFeasibility(game, drawn[f], best[f], best[1 - f], seed);
+                    }
+            }
+            touches.clear();
+            for (int f = 0; f < 2; ++f)
+                touches.push_back(GameState::Touch{&fingers[f], paths[f].back(), true});
+            game.touchesEnded(touches);
+
+            bool incomplete;
+            if (!game.match(incomplete)) {
+                // Another copy of the shape is on the board. Tap the selections away and move on.
+                game.tapped(paths[0][0]);
+                game.tapped(paths[1][0]);
+                break;
+            }
+
+            // As the app's analysis would, once the match has noted the cleared cells.
+            MoveIndex moves = game.moves();
+            moves.update(game.board());
+            game.setMoves(moves);
+        }
+        stateHash = TouchReplay::stateHash(game);
+        return recorder.trace();
+    }
+
+    // A crowd of fingers, each round touching down on free cells and dragging out three-cell selections together.
+    // Selections pile up until there's no room for more, then a tap on a free cell clears them all.
+    TouchTrace stress(size_t seed, size_t width, size_t height, Options const & opts, size_t & stateHash) {
+        GameState game(opts.nColors, width, height, &seed);
+        TouchRecorder recorder(game);
+        std::mt19937 gen(seed);
+        std::vector<char> fingers(opts.fingers);
+
+        auto occupied = game.board().computeMask();
+        for (size_t round = 0; round < opts.rounds; ++round) {
+            auto taken = BitBoard::empty();
+            for (auto const & sel : game.sels())
+                taken |= sel.second.is_selected;
+
+            // Plan a path for each finger over free cells: a start and two steps, each next to the last.
+            std::vector<std::vector<vec2>> paths;
+            for (size_t f = 0; f < fingers.size() && game.sels().size() + paths.size() < 256 / 3; ++f)
+                for (int attempt = 0; attempt < 8; ++attempt) {
+                    int x = gen() % width, y = gen() % height;
+                    auto cell = BitBoard::single(x, y), path = cell;
+                    std::vector<vec2> p{vec2{float(x), float(y)}};
+                    if (!(cell & occupied & ~taken))
+                        continue;
+                    while (p.size() < 3) {
+                        auto next = cell.nhood4() & occupied & ~taken & ~path;
+                        if (!next)
+                            break;
+                        cell = next.ls1b();
+                        path |= cell;
+                        for (int y = 0; y < 16; ++y)
+                            for (int x = 0; x < 16; ++x)
+                                if (cell.isSet(x, y))
+                                    p.push_back(vec2{float(x), float(y)});
+                    }
+                    if (p.size() < 3)
+                        continue;
+                    taken |= path;
+                    paths.push_back(p);
+                    break;
+                }
+
+            if (paths.empty()) {
+                // Full up: tap a free cell, or any cell, to clear everything.
+                auto free = ~taken & occupied;
+                auto at = (free ? free : occupied).ls1b();
+                for (int y = 0; y < 16; ++y)
+                    for (int x = 0; x < 16; ++x)
+                        if (at.isSet(x, y))
+                            game.tapped(vec2{float(x), float(y)});
+                continue;
+            }
+
+            std::vector<GameState::Touch> touches;
+            for (size_t f = 0; f < paths.size(); ++f)
+                touches.push_back(GameState::Touch{&fingers[f], paths[f][0], false});
+            game.touchesBegan(touches);
+            for (size_t step = 0; step < 3; ++step) {
+                for (size_t f = 0; f < paths.size(); ++f)
+                    touches[f] = GameState::Touch{&fingers[f], paths[f][step], true};
+                game.touchesMoved(touches);
+            }
+            game.touchesEnded(touches);
+        }
+        stateHash = TouchReplay::stateHash(game);
+        return recorder.trace();
+    }
+
+    char const * inputName(size_t i) {
+        static char const * const names[] = {"touchesBegan", "touchesMoved", "touchesEnded", "touchesCancelled", "tapped", "match"};
+        return names[i];
+    }
+
+    double percentile(std::vector<double> us, double p) {
+        if (us.empty()) return 0;
+        std::sort(begin(us), end(us));
+        return us[std::min(us.size() - 1, static_cast<size_t>(p * us.size()))];
+    }
+
+    void print(std::ostream & os, std::string const & title, std::vector<TouchReplay::Result> const & results) {
+        size_t hash = 0, matches = 0;
+        for (auto const & r : results) {
+            hash += r.stateHash;
+            matches += r.matches;
+        }
+        os << title << ", " << results.size() << " games: " << matches << " matches, state hash " << std::hex << hash << std::dec << "\n";
+        for (size_t i = 0; i < size_t(GameState::Input::nInputs); ++i) {
+            std::vector<double> us;
+            for (auto const & r : results)
+                us.insert(end(us), begin(r.us[i]), end(r.us[i]));
+            if (us.empty())
+                continue;
+            os << "    " << std::left << std::setw(18) << inputName(i) << std::right << std::fixed << std::setprecision(1)
+               << " n=" << std::setw(6) << us.size()
+               << "  p50=" << std::setw(9) << percentile(us, 0.5)
+               << "  p90=" << std::setw(9) << percentile(us, 0.9)
+               << "  p99=" << std::setw(9) << percentile(us, 0.99)
+               << "  max=" << std::setw(9) << percentile(us, 1) << " µs\n";
+        }
+    }
+
+    void usage(char const * argv0) {
+        std::cerr << "usage: " << argv0 << " [--seeds N] [--first-seed HEX] [--size WxH]... [--colors N] [--turns N] [--fingers N] [--rounds N] [--realtime] [--save DIR] [TRACE...]\n";
+        std::exit(2);
+    }
+
+}
+
+int main(int argc, char * argv[]) {
+    Options opts;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = [&]{ if (++i == argc) usage(argv[0]); return argv[i]; };
+        if (!std::strcmp(argv[i], "--seeds")) {
+            opts.nSeeds = std::strtoul(arg(), nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--first-seed")) {
+            opts.firstSeed = std::strtoul(arg(), nullptr, 16);
+        } else if (!std::strcmp(argv[i], "--size")) {
+            size_t w, h;
+            if (std::sscanf(arg(), "%zux%zu", &w, &h) != 2 || !w || !h || w > 16 || h > 16) usage(argv[0]);
+            opts.sizes.emplace_back(w, h);
+        } else if (!std::strcmp(argv[i], "--colors")) {
+            opts.nColors = std::strtoul(arg(), nullptr, 10);
+            if (opts.nColors < 2 || opts.nColors > Board::maxColors) usage(argv[0]);
+        } else if (!std::strcmp(argv[i], "--turns")) {
+            opts.turns = std::strtoul(arg(), nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--fingers")) {
+            opts.fingers = std::strtoul(arg(), nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--rounds")) {
+            opts.rounds = std::strtoul(arg(), nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--realtime")) {
+            opts.realTime = true;
+        } else if (!std::strcmp(argv[i], "--save")) {
+            opts.save = arg();
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+        } else {
+            opts.traces.push_back(argv[i]);
+        }
+    }
+
+    // Replay the traces given.
+    if (!opts.traces.empty()) {
+        std::vector<TouchReplay::Result> results;
+        for (auto const & path : opts.traces) {
+            std::ifstream is(path, std::ios::binary);
+            TouchTrace trace;
+            if (!trace.read(is)) {
+                std::cerr << "Failed to read " << path << "\n";
+                return 1;
+            }
+            results.push_back(TouchReplay::run(trace, opts.realTime));
+            print(std::cout, path, {results.back()});
+        }
+        return 0;
+    }
+
+    // The board sizes the app ships: iPhone and iPad.
+    if (opts.sizes.empty())
+        opts.sizes = {{12, 8}, {16, 16}};
+
+    typedef TouchTrace (*Game)(size_t, size_t, size_t, Options const &, size_t &);
+    struct Kind {
+        char const * name;
+        Game game;
+    };
+    std::vector<Kind> kinds{{"", play}};
+    if (opts.fingers)
+        kinds.push_back(Kind{"stress", stress});
+
+    size_t mismatches = 0;
+    for (auto const & kind : kinds)
+        for (auto const & size : opts.sizes) {
+            std::vector<TouchReplay::Result> results, underLoad;
+            size_t analyses = 0;
+            for (size_t s = 0; s < opts.nSeeds; ++s) {
+                size_t seed = opts.firstSeed + s, played;
+                if (kind.game == play)
+                    checkReassessment(seed, size.first, size.second, opts);
+                auto trace = kind.game(seed, size.first, size.second, opts, played);
+
+                // Replay the saved form, so that the format is checked too.
+                std::stringstream saved;
+                trace.write(saved);
+                TouchTrace loaded;
+                if (!loaded.read(saved)) {
+                    std::cerr << "Seed " << std::hex << seed << std::dec << ": saved trace doesn't read back\n";
+                    ++mismatches;
+                    continue;
+                }
+                results.push_back(TouchReplay::run(loaded, opts.realTime));
+                if (results.back().stateHash != played) {
+                    std::cerr << "Seed " << std::hex << seed << std::dec << ": replay ends in a different state\n";
+                    ++mismatches;
+                }
+                if (kind.game == stress) {
+                    // Replay until a few analyses have run, since one replay is over before an analysis is.
+                    GameState game(opts.nColors, size.first, size.second, &seed);
+                    AnalysisLoad load(game.board());
+                    underLoad.push_back(TouchReplay::run(loaded, opts.realTime));
+                    while (load.analyses() < 2) {
+                        auto again = TouchReplay::run(loaded, opts.realTime);
+                        for (size_t i = 0; i < again.us.size(); ++i)
+                            underLoad.back().us[i].insert(end(underLoad.back().us[i]), begin(again.us[i]), end(again.us[i]));
+                    }
+                    analyses += load.analyses();
+                }
+
+                if (!opts.save.empty()) {
+                    std::ostringstream path;
+                    path << opts.save << "/" << (*kind.name ? kind.name : "play") << "-" << size.first << "x" << size.second
+                         << "-" << std::hex << seed << ".ttr";
+                    std::ofstream os(path.str(), std::ios::binary);
+                    trace.write(os);
+                    if (!os) {
+                        std::cerr << "Failed to write " << path.str() << "\n";
+                        return 1;
+                    }
+                }
+            }
+            std::ostringstream title;
+            title << size.first << "x" << size.second << " " << opts.nColors << " colors";
+            if (*kind.name)
+                title << " " << kind.name << ", " << opts.fingers << " fingers";
+            print(std::cout, title.str(), results);
+            if (!underLoad.empty()) {
+                title << ", replayed under " << analyses << " background analyses";
+                print(std::cout, title.str(), underLoad);
+            }
+        }
+
+    return mismatches || infeasible || misdimmed ? 1 : 0;
+}